@@ -80,6 +80,46 @@ void * bad_realloc(void *ptr, size_t size) {
   return newptr;
 }
 
+// bad_memalign - Ignores the alignment altogether.
+void * bad_memalign(size_t alignment, size_t size) {
+  return bad_malloc(size);
+}
+
+// bad_calloc - Forgets to clear the memory.
+void * bad_calloc(size_t nmemb, size_t size) {
+  return bad_malloc(nmemb * size);
+}
+
+// bad_malloc_hint - Ignores the hint.
+void * bad_malloc_hint(size_t size, unsigned hint) {
+  return bad_malloc(size);
+}
+
+// bad_malloc_usable_size - Every block is BAD_SIZE, whatever was asked for.
+size_t bad_malloc_usable_size(void *ptr) {
+  return BAD_SIZE;
+}
+
+// bad_malloc_batch - One bad_malloc per block.
+size_t bad_malloc_batch(size_t size, size_t n, void **ptrs) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    if ((ptrs[i] = bad_malloc(size)) == NULL) {
+      break;
+    }
+  }
+  return i;
+}
+
+// bad_free_batch - Does nothing, like bad_free.
+void bad_free_batch(void **ptrs, size_t n) {
+  // Do nothing.
+}
+
+// bad_reserve - Does nothing.
+int bad_reserve(const size_t *sizes, const size_t *counts, size_t n) {
+  return 0;
+}
 
 // call mem_reset_brk.
 void bad_reset_brk() {
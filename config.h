@@ -26,17 +26,74 @@
 #define MAX_BASE_THROUGHPUT (64000e3) /* in kops/sec */
 
 /*
- * Alignment requirement in bytes (8)
+ * Alignment requirement in bytes (8). Follows the allocator's ALIGNMENT
+ * when that is set on the command line (e.g. PARAMS=-DALIGNMENT=16).
  */
+#ifndef R_ALIGNMENT
+#ifdef ALIGNMENT
+#define R_ALIGNMENT ALIGNMENT
+#else
 #define R_ALIGNMENT 8
+#endif
+#endif
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes. memlib only reserves address space for it
+ * up front, so it can be large; set it on the command line
+ * (e.g. -DMAX_HEAP='(50*((size_t)1<<20))') to model a smaller machine.
  */
-#define MAX_HEAP (50*(1<<20))  /* 50 MB */
+#ifndef MAX_HEAP
+#define MAX_HEAP (64*((size_t)1<<30))  /* 64 GB */
+#endif
+
+/*
+ * With MEM_HUGETLB, the most reserved huge pages the main heap takes.
+ * They are reserved for good at startup, so this leaves the rest of the
+ * system's pool to other processes; past it the heap carries on in
+ * segments of ordinary pages.
+ */
+#ifndef MEM_HUGETLB_MAX
+#define MEM_HUGETLB_MAX (256*((size_t)1<<20))  /* 256 MB */
+#endif
 
 #define MEM_ALLOWANCE (40 * (1 << 10)) /* 40 KB */
 
+/*
+ * Pre-warming (-w) only reserves sizes that have at least this many
+ * blocks live at once somewhere in the trace
+ */
+#define WARM_MIN_COUNT 8
+
+/*
+ * How often the mm maintenance thread (-m) wakes up, in microseconds
+ */
+#define MAINT_INTERVAL_US 1000
+
+/*
+ * Shape of the streaming microbenchmark (-s): this many same-sized
+ * buffers are walked side by side, one of them written and the rest read,
+ * a tile at a time. Buffers this big are mapped blocks in the mm package.
+ */
+#define STREAM_BUFFERS 16
+#define STREAM_BYTES (256 * (1 << 10)) /* 256 KB */
+#define STREAM_TILE (2 * (1 << 10))    /* 2 KB */
+#define STREAM_PASSES 16
+
+/*
+ * Shape of the pool microbenchmark (-o): this many objects of this size
+ * are kept live, and each round replaces every one of them
+ */
+#define POOL_OBJECTS 4096
+#define POOL_OBJECT_BYTES 48
+#define POOL_ROUNDS 16
+
+/*
+ * Backing bytes of each of the heap instances that -I spreads a trace
+ * over. Blocks that do not fit go to the default heap instead.
+ */
+#define HEAP_INSTANCES 2
+#define HEAP_INSTANCE_BYTES (1 << 20)
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
@@ -0,0 +1,247 @@
+/**
+ * Copyright (c) 2015 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+/*
+ * kernels.c - copy and clear loops for moving payloads around.
+ *
+ * Both ends of every copy are payloads, so they are at least 8-byte
+ * aligned and do not overlap. Moves smaller than the per-core cache
+ * (nt_threshold, the L2 size: about 1 MB) go straight to memcpy/memset,
+ * which are already tuned for data that stays in cache, so the aligned
+ * vector loops below only ever see moves at least that big. Those are
+ * streamed out with non-temporal stores, so that moving them does not
+ * evict the working set on the way through; libc sizes its own cutoff
+ * from the shared cache, which can be far too large. The first call picks
+ * the widest vector unit the CPU has (AVX2, then SSE2, then plain
+ * memcpy/memset).
+ *
+ * Build with -DUSE_LIBC_KERNELS to fall back to memcpy/memset everywhere.
+ * mdriver -K compares the two at run time (see block_kernels).
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "./kernels.h"
+
+// Moves at least this big use non-temporal stores when the size of the
+// per-core cache cannot be found (tunable value)
+#define DEFAULT_NT_THRESHOLD (1024 * 1024)
+
+static size_t nt_threshold = DEFAULT_NT_THRESHOLD;
+
+// Name of the kernels select_kernels picked
+static const char *kernel_name = "libc";
+
+static void copy_resolve(void *dst, const void *src, size_t size);
+static void zero_resolve(void *dst, size_t size);
+
+// The kernels in use. They start out pointing at the resolvers, which
+// replace them with the best kernels for this CPU on the first call.
+static void (*copy_kernel)(void *, const void *, size_t) = &copy_resolve;
+static void (*zero_kernel)(void *, size_t) = &zero_resolve;
+
+void block_copy(void *dst, const void *src, size_t size) {
+  copy_kernel(dst, src, size);
+}
+
+void block_zero(void *dst, size_t size) {
+  zero_kernel(dst, size);
+}
+
+static void copy_libc(void *dst, const void *src, size_t size) {
+  memcpy(dst, src, size);
+}
+
+static void zero_libc(void *dst, size_t size) {
+  memset(dst, 0, size);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// SSE2: 64 bytes per iteration. Loads are unaligned (payloads are only
+// 8-byte aligned by default); the streaming stores need the destination
+// brought up to a 16-byte boundary first.
+static void copy_sse2(void *dst, const void *src, size_t size) {
+  if (size < nt_threshold) {
+    memcpy(dst, src, size);
+    return;
+  }
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+  const size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+
+  for (; size >= 64; size -= 64, d += 64, s += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+    __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+    _mm_stream_si128((__m128i *)d, a);
+    _mm_stream_si128((__m128i *)(d + 16), b);
+    _mm_stream_si128((__m128i *)(d + 32), c);
+    _mm_stream_si128((__m128i *)(d + 48), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+static void zero_sse2(void *dst, size_t size) {
+  if (size < nt_threshold) {
+    memset(dst, 0, size);
+    return;
+  }
+  uint8_t *d = (uint8_t *)dst;
+  const size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+  memset(d, 0, head);
+  d += head;
+  size -= head;
+
+  const __m128i zero = _mm_setzero_si128();
+  for (; size >= 64; size -= 64, d += 64) {
+    _mm_stream_si128((__m128i *)d, zero);
+    _mm_stream_si128((__m128i *)(d + 16), zero);
+    _mm_stream_si128((__m128i *)(d + 32), zero);
+    _mm_stream_si128((__m128i *)(d + 48), zero);
+  }
+  _mm_sfence();
+  memset(d, 0, size);
+}
+
+// AVX2: the same shape with 32-byte vectors and 128 bytes per iteration.
+__attribute__((target("avx2")))
+static void copy_avx2(void *dst, const void *src, size_t size) {
+  if (size < nt_threshold) {
+    memcpy(dst, src, size);
+    return;
+  }
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+  const size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+
+  for (; size >= 128; size -= 128, d += 128, s += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_stream_si256((__m256i *)d, a);
+    _mm256_stream_si256((__m256i *)(d + 32), b);
+    _mm256_stream_si256((__m256i *)(d + 64), c);
+    _mm256_stream_si256((__m256i *)(d + 96), e);
+  }
+  _mm_sfence();
+  _mm256_zeroupper();
+  memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void zero_avx2(void *dst, size_t size) {
+  if (size < nt_threshold) {
+    memset(dst, 0, size);
+    return;
+  }
+  uint8_t *d = (uint8_t *)dst;
+  const size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+  memset(d, 0, head);
+  d += head;
+  size -= head;
+
+  const __m256i zero = _mm256_setzero_si256();
+  for (; size >= 128; size -= 128, d += 128) {
+    _mm256_stream_si256((__m256i *)d, zero);
+    _mm256_stream_si256((__m256i *)(d + 32), zero);
+    _mm256_stream_si256((__m256i *)(d + 64), zero);
+    _mm256_stream_si256((__m256i *)(d + 96), zero);
+  }
+  _mm_sfence();
+  _mm256_zeroupper();
+  memset(d, 0, size);
+}
+
+#endif  // HAVE_X86_KERNELS
+
+// Pick the kernels for this CPU and work out the non-temporal threshold
+static void select_kernels(void) {
+  copy_kernel = &copy_libc;
+  zero_kernel = &zero_libc;
+  kernel_name = "libc";
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  long cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  if (cache_size > 0) {
+    nt_threshold = (size_t)cache_size;
+  }
+#endif
+
+#if defined(HAVE_X86_KERNELS) && !defined(USE_LIBC_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    copy_kernel = &copy_avx2;
+    zero_kernel = &zero_avx2;
+    kernel_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    copy_kernel = &copy_sse2;
+    zero_kernel = &zero_sse2;
+    kernel_name = "sse2";
+  }
+#endif
+}
+
+const char *block_kernels(int libc) {
+  select_kernels();
+  if (libc) {
+    copy_kernel = &copy_libc;
+    zero_kernel = &zero_libc;
+    return "libc";
+  }
+  return kernel_name;
+}
+
+size_t block_nt_threshold(void) {
+  if (copy_kernel == &copy_resolve) {
+    select_kernels();
+  }
+  return nt_threshold;
+}
+
+static void copy_resolve(void *dst, const void *src, size_t size) {
+  select_kernels();
+  copy_kernel(dst, src, size);
+}
+
+static void zero_resolve(void *dst, size_t size) {
+  select_kernels();
+  zero_kernel(dst, size);
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) 2015 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+#ifndef MM_KERNELS_H
+#define MM_KERNELS_H
+
+#include <stdlib.h>
+
+// Copy size bytes between two non-overlapping payloads
+void block_copy(void *dst, const void *src, size_t size);
+
+// Clear size bytes of a payload
+void block_zero(void *dst, size_t size);
+
+// Switch block_copy and block_zero between the vector kernels picked for
+// this CPU (libc == 0) and plain memcpy/memset (libc != 0), to compare the
+// two. Returns the name of the kernels now in use: "avx2", "sse2" or "libc".
+const char *block_kernels(int libc);
+
+// The vector kernels only take over from memcpy/memset for moves of at
+// least this many bytes: the per-core (L2) cache size, or 1 MB if that
+// cannot be found. Smaller moves cost the same either way.
+size_t block_nt_threshold(void);
+
+#endif  // MM_KERNELS_H
@@ -47,7 +47,10 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
-typedef enum {ALLOC, FREE, REALLOC, WRITE} traceop_type; /* type of request */
+typedef enum {ALLOC, FREE, REALLOC, WRITE, MEMALIGN, CALLOC,
+              BATCH_ALLOC, BATCH_FREE, REGION_NEW, REGION_ALLOC,
+              REGION_RESET, REGION_DESTROY, HANDLE_ALLOC, HANDLE_FREE,
+              HANDLE_LOCK, HANDLE_UNLOCK, COMPACT} traceop_type; /* type of request */
 /******************************
  * The key compound data types
  *****************************/
@@ -56,7 +59,12 @@ typedef enum {ALLOC, FREE, REALLOC, WRITE} traceop_type; /* type of request */
 typedef struct {
   traceop_type  type; /* type of request */
   int index;                        /* index for free() to use later */
-  int size;                         /* byte size of alloc/realloc request */
+  size_t size;                      /* byte size of alloc/realloc request */
+  size_t alignment;                 /* payload alignment of memalign request */
+  unsigned count;                   /* ids index..index+count-1 of a batch */
+  unsigned hint;                    /* MY_HINT_* lifetime hint of an alloc */
+  unsigned region;                  /* region of a REGION_* request */
+  unsigned locked;                  /* how many of a compact's ids are locked */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -68,6 +76,16 @@ typedef struct {
   traceop_t *ops;      /* array of requests */
   char **blocks;       /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+  size_t num_warm;     /* sizes to reserve after init (set by -w)... */
+  size_t *warm_sizes;  /* ... the sizes themselves... */
+  size_t *warm_counts; /* ... and how many blocks of each */
+  int num_reallocs;    /* number of realloc requests */
+  int num_regions;     /* number of region ids */
+  my_region_t **regions; /* the live regions, by id... */
+  int *region_ids;     /* ... and the ids each reset or destroy drops */
+  my_handle_t *handles; /* the handle of each id from a HANDLE_ALLOC... */
+  int *handle_ids;     /* ... and the live ones at each compact */
+  size_t trimmed;      /* bytes the compacts gave back in eval_mm_util */
 } trace_t;
 
 /*********************
@@ -77,5 +95,12 @@ typedef struct {
 void malloc_error(int tracenum, int opnum, char *msg);
 void unix_error(char *msg);
 void app_error(char *msg);
+int trace_region_new(const malloc_impl_t *impl, trace_t *trace, traceop_t *op);
+char *trace_region_alloc(const malloc_impl_t *impl, trace_t *trace, traceop_t *op);
+void trace_region_drop(const malloc_impl_t *impl, trace_t *trace, traceop_t *op);
+char *trace_handle_alloc(const malloc_impl_t *impl, trace_t *trace, int id, size_t size);
+void trace_handle_free(const malloc_impl_t *impl, trace_t *trace, int id);
+char *trace_handle_lock(const malloc_impl_t *impl, trace_t *trace, int id);
+void trace_handle_unlock(const malloc_impl_t *impl, trace_t *trace, int id);
 
 #endif  // MM_MDRIVER_H
@@ -23,15 +23,43 @@
 #ifndef MM_MEMLIB_H
 #define MM_MEMLIB_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 void mem_init(void);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_sbrk_try(intptr_t incr);
+void mem_out_of_memory(void);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_clean(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
 size_t mem_pagesize(void);
 
+/* Page mappings outside the brk heap, for large blocks */
+void *mem_map(size_t len);
+void mem_unmap(void *addr, size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+int mem_contains(void *lo, void *hi);
+
+/* Resident memory: hand idle pages back, and see what is still backed */
+size_t mem_purge(void *addr, size_t len);
+size_t mem_resident(void);
+
+/* Page size of the brk heap: transparent huge pages, or base pages only */
+int mem_huge_pages(int on);
+
+/* What backs the brk heap (see mem_is_huge) */
+#define MEM_HUGE_NONE 0         /* base pages */
+#define MEM_HUGE_TRANSPARENT 1  /* transparent huge pages, asked for */
+#define MEM_HUGE_RESERVED 2     /* reserved huge pages (MEM_HUGETLB) */
+int mem_is_huge(void);
+
+/* Page faults: take them ahead of the break, or all over again */
+int mem_prefault(size_t distance, int async);
+void mem_evict(void);
+
 #endif  // MM_MEMLIB_H
@@ -25,7 +25,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#ifdef BACKGROUND_MAINTENANCE
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(BACKGROUND_MAINTENANCE) || defined(DECAY_PURGE)
+#include <time.h>
+#endif
 #include "./allocator_interface.h"
+#include "./kernels.h"
 #include "./memlib.h"
 
 // Don't call libc malloc!
@@ -35,21 +44,37 @@
 
 // All blocks must have a specified minimum alignment.
 // The alignment requirement (from config.h) is >= 8 bytes.
+// Build with -DALIGNMENT=16 for payloads that satisfy the x86-64 ABI
+// (long double, SSE). Larger alignments go through my_memalign, since
+// memlib only promises a 16-byte aligned heap start.
 #ifndef ALIGNMENT
 #define ALIGNMENT 8
 #endif
 
+#if (ALIGNMENT != 8) && (ALIGNMENT != 16)
+#error "ALIGNMENT must be 8 or 16"
+#endif
+
 // Built in function that can find the offsetof a struct to one of its fields
 #define offsetof(type, member)  __builtin_offsetof (type, member)
 
-// Built in function that calculates the number of zero_bits on the left of a number
-#define left_zeros(size) __builtin_clz (size)
+// Built in function that calculates the number of zero_bits on the left of a number.
+// Sizes are size_t, so use the long variant to see all 64 bits.
+#define left_zeros(size) __builtin_clzl (size)
+
+// Number of bits in a size_t, used to turn left_zeros into a log2
+#define SIZE_T_BITS (8 * sizeof(size_t))
 
 // Rounds up to the nearest multiple of ALIGNMENT.
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
-// The total number of free_lists we'll use
-#define LIST_SIZE 25
+// The total number of free_lists we'll use. One bin per power of two
+// so that every size_t has a bin.
+#define LIST_SIZE 64
+
+// Largest request we will try to satisfy. Anything bigger would overflow
+// ALIGN() or the header arithmetic below, so it is refused up front.
+#define MAX_REQUEST (SIZE_MAX / 2)
 
 typedef struct header_t { 
   size_t size;
@@ -57,15 +82,34 @@ typedef struct header_t {
   struct header_t * prev;
 } header_t;
 
-#define HEADER_T_SIZE ALIGN(sizeof(header_t))
+#define HEADER_T_SIZE sizeof(header_t)
 
 typedef struct footer_t {
   size_t size;
 } footer_t;
 
-#define FOOTER_T_SIZE ALIGN(sizeof(footer_t))
+// The tags are packed, not padded out to ALIGNMENT. A block looks like
+//
+//   | size | payload ... | footer | size | payload ... | footer |
+//
+// so the distance from one payload to the next is payload + TAGS_SIZE.
+// Payload sizes are rounded so that this distance is a multiple of
+// ALIGNMENT, and the first block is pushed out by HEAP_PAD so that its
+// payload is aligned. Every payload after it is then aligned for free.
+#define FOOTER_T_SIZE sizeof(footer_t)
+
+#define TAGS_SIZE (offsetof(header_t, next) + FOOTER_T_SIZE)
+
+#define HEAP_PAD ((ALIGNMENT - offsetof(header_t, next) % ALIGNMENT) % ALIGNMENT)
 
-#define FREE_HEADER_SIZE HEADER_T_SIZE-offsetof(header_t, next)
+// Rounds a payload size up so that payload + tags is a multiple of ALIGNMENT.
+#define ALIGN_PAYLOAD(size) (ALIGN((size) + TAGS_SIZE) - TAGS_SIZE)
+
+#define FREE_HEADER_SIZE (HEADER_T_SIZE-offsetof(header_t, next))
+
+// The smallest block that can sit on a free list: the size tag, room for
+// the next/prev pointers and the footer
+#define MIN_BLOCK_SIZE (offsetof(header_t, next) + (FREE_HEADER_SIZE) + FOOTER_T_SIZE)
 
 // We will use the very last bit of a 64-bit number to
 // represent whether a block is free or not. Because we know
@@ -73,14 +117,32 @@ typedef struct footer_t {
 // always be zero, so we can use it to store a bit of info.
 #define FREE_BIT 0x0000000000000001
 
+// The next bit up marks a large block that has its own pages from mem_map
+// instead of living in the heap (see mapped_t below).
+#define MAPPED_BIT 0x0000000000000002
+
+// The last spare bit marks a block that belongs to a short-lived chunk
+// (see my_malloc_hint). Free blocks with it set live on short_lists.
+#define SHORT_BIT 0x0000000000000004
+
+// All of the bits in the size field that are not part of the size
+#define FLAG_BITS (FREE_BIT | MAPPED_BIT | SHORT_BIT)
+
 // Returns 1 if chunk is free, 0 otherwise
 #define is_free(chunk) ((chunk)->size & FREE_BIT) 
 
-// Set's the new size of a chunk, keeping it's in use status the same
-#define set_size(new_size, chunk) ((chunk)->size = (new_size)|(is_free(chunk))) 
+// Returns nonzero if chunk was mapped on its own rather than carved from the heap
+#define is_mapped(chunk) ((chunk)->size & MAPPED_BIT)
+
+// Returns nonzero if chunk was carved from a short-lived chunk
+#define is_short(chunk) (((chunk)->size & SHORT_BIT) != 0)
 
-// Get the size of a specific chunk of memory, masking out the free_bit
-#define get_size(chunk) ((chunk)->size & ~FREE_BIT)
+// Set's the new size of a chunk, keeping it's in use status and lifetime
+// class the same. Only for heap blocks, so this also clears MAPPED_BIT.
+#define set_size(new_size, chunk) ((chunk)->size = (new_size) | ((chunk)->size & (FREE_BIT | SHORT_BIT)))
+
+// Get the size of a specific chunk of memory, masking out the flag bits
+#define get_size(chunk) ((chunk)->size & ~FLAG_BITS)
 
 // This block of memory is now free, mark it appropriately
 #define set_free(chunk) ((chunk)->size |= FREE_BIT)
@@ -89,47 +151,528 @@ typedef struct footer_t {
 #define set_in_use(chunk) ((chunk)->size &= ~FREE_BIT)
 
 // This represents the minimum size we should split at (tunable value)
+#ifndef SPLIT_CONSTANT
 #define SPLIT_CONSTANT 112
+#endif
+
+// Short-lived requests are carved from chunks of at least this many bytes,
+// taken from the main heap. Once the short-lived blocks around a free one
+// have all been freed and it has grown back to this size, it is returned
+// to the main heap (tunable value)
+#define SHORT_CHUNK (64 * 1024)
+
+// With NURSERY defined, my_malloc requests of at most NURSERY_MAX bytes are
+// bump-allocated from a chunk of NURSERY_CHUNK bytes, taken from the main
+// heap, that the calling thread has to itself (tunable values)
+#ifndef NURSERY_CHUNK
+#define NURSERY_CHUNK (64 * 1024)
+#endif
+#ifndef NURSERY_MAX
+#define NURSERY_MAX 256
+#endif
+
+#ifdef NURSERY
+// A nursery chunk is a block from the main heap that starts with this.
+// Small blocks are carved off it back to back, each with a one word header
+// that has both FREE_BIT and MAPPED_BIT set (which no other block has),
+// its usable size in the low half and its offset into the chunk in the
+// high half. The chunk counts its live blocks, and free is no more than a
+// decrement: the thread's current chunk starts over from the beginning
+// once the count drops to zero. A chunk that fills up with blocks still
+// live is retired where it is, and goes back to the main heap when its
+// last block is freed.
+typedef struct nursery_t {
+  size_t live;
+  bool retired;
+} nursery_t;
+
+#define NURSERY_TAG (FREE_BIT | MAPPED_BIT)
+#define is_nursery(chunk) (((chunk)->size & NURSERY_TAG) == NURSERY_TAG)
+#define nursery_size(chunk) ((chunk)->size & 0xFFFFFFFF & ~FLAG_BITS)
+#define nursery_of(chunk) ((nursery_t *)((uint8_t *)(chunk) - ((chunk)->size >> 32)))
+
+// Offset of the first block's header, so that its payload is aligned
+#define NURSERY_FIRST (ALIGN(sizeof(nursery_t) + offsetof(header_t, next)) - \
+                       offsetof(header_t, next))
+
+_Static_assert(NURSERY_CHUNK <= 0xFFFFFFFF, "nursery offsets must fit in 32 bits");
+_Static_assert(NURSERY_FIRST + ALIGN(NURSERY_MAX + offsetof(header_t, next)) <= NURSERY_CHUNK,
+               "NURSERY_CHUNK must hold a block of NURSERY_MAX bytes");
+
+// This thread's chunk and the unused bytes at its end. epoch is that of
+// the heap the chunk came from (the default heap's nursery_epoch): my_init
+// starts a new one, and a chunk of an older heap went away with it.
+static __thread struct {
+  nursery_t * chunk;
+  uint8_t * cur;
+  uint8_t * end;
+  unsigned epoch;
+} nursery;
+#endif
+
+// With DENSE_SMALL defined, long-lived my_malloc requests of at most
+// DENSE_MAX bytes come from slabs: chunks of DENSE_CHUNK bytes taken from
+// the main heap, each cut into objects of a single size class. The hot
+// small objects of a program then sit packed side by side in a few pages
+// (a few huge pages, with HUGE=1) instead of being strewn between larger
+// blocks, and each class's chunks are kept on a list of their own rather
+// than marked with a lifetime class (tunable values)
+#ifndef DENSE_CHUNK
+#define DENSE_CHUNK (16 * 1024)
+#endif
+#ifndef DENSE_MAX
+#define DENSE_MAX 128
+#endif
+
+#ifdef DENSE_SMALL
+#ifdef NURSERY
+#error "NURSERY and DENSE_SMALL both take over the small requests; build with one of them"
+#endif
+
+// A slab is a block from the main heap that starts with this. Its objects
+// have the one word header of a nursery block (both FREE_BIT and
+// MAPPED_BIT set, the usable size in the low half and the offset into the
+// chunk in the high half), which stays put while the object is free. Free
+// objects are chained through their first word. A chunk with room left is
+// on its class's list in my_heap_t; once all of its objects are free it
+// goes back to the main heap, unless it is the last chunk on that list.
+typedef struct dense_t {
+  struct dense_t * next;  // the class's other chunks with room
+  struct dense_t * prev;
+  void * free;            // objects given back
+  uint8_t * cur;          // objects never handed out start here
+  uint8_t * end;
+  size_t live;
+  size_t stride;          // header and payload of one object
+  bool listed;            // on its class's list
+} dense_t;
+
+#define DENSE_TAG (FREE_BIT | MAPPED_BIT)
+#define is_dense(chunk) (((chunk)->size & DENSE_TAG) == DENSE_TAG)
+#define dense_size(chunk) ((chunk)->size & 0xFFFFFFFF & ~FLAG_BITS)
+#define dense_of(chunk) ((dense_t *)((uint8_t *)(chunk) - ((chunk)->size >> 32)))
+
+// Offset of the first object's header, so that its payload is aligned
+#define DENSE_FIRST (ALIGN(sizeof(dense_t) + offsetof(header_t, next)) - \
+                     offsetof(header_t, next))
+
+// Header and payload of an object of size bytes, and its class
+#define DENSE_STRIDE(size) ALIGN((size) + ((size) == 0) + offsetof(header_t, next))
+#define DENSE_CLASSES (DENSE_STRIDE(DENSE_MAX) / ALIGNMENT + 1)
+
+_Static_assert(DENSE_CHUNK <= 0xFFFFFFFF, "slab offsets must fit in 32 bits");
+_Static_assert(DENSE_FIRST + DENSE_STRIDE(DENSE_MAX) <= DENSE_CHUNK,
+               "DENSE_CHUNK must hold an object of DENSE_MAX bytes");
+#endif
+
+// Requests at least this big get pages of their own from mem_map instead
+// of a block in the heap. realloc can then move or grow them with
+// mem_remap, which costs a system call rather than a copy (tunable value)
+#define MMAP_THRESHOLD (256 * 1024)
+
+// Mapped blocks would all put their payload at the same offset into a
+// page, so buffers walked side by side would fight over the same cache
+// sets (and trip 4K aliasing between loads and stores). Each new mapping
+// moves its payload one line further in, cycling through this many
+// colors. Define it as 1 to turn coloring off (tunable value)
+#ifndef MAP_COLORS
+#define MAP_COLORS 32
+#endif
+
+// A mapped block starts with this, placed so that size sits right before
+// the payload just like the size tag of a heap block. There is no footer:
+// mapped blocks never take part in coalescing.
+typedef struct mapped_t {
+  size_t offset;  // bytes from the start of the mapping to the payload
+  size_t size;    // usable payload bytes, with MAPPED_BIT set
+} mapped_t;
+
+// With CACHE_LINE_PLACEMENT defined, payloads of requests at least this big
+// start on a line boundary, so that a line-sized object is filled with one
+// miss instead of two. See malloc_on_line.
+#define CACHE_LINE_SIZE 64
 
 // This represents the number of blocks we should check after we find a free block fit
 // to see if we can find a better fit (tunable value)
+#ifndef BEST_CONSTANT
 #define BEST_CONSTANT 4
+#endif
+
+// Placement policies: which of the free blocks that fit a request malloc
+// takes. Whatever the policy, a block from a bigger bin than the request's
+// is split (see SPLIT_CONSTANT) and one from the request's own bin is not.
+typedef enum {
+  PLACE_BEST,     // the best of the first fit and the BEST_CONSTANT after it
+  PLACE_FIRST,    // the first fit
+  PLACE_NEXT,     // the first fit from where the last search left off
+  PLACE_ADDRESS,  // the lowest addressed fit in the first bin with one
+  PLACE_COUNT
+} placement_t;
+
+static const char * const placement_names[PLACE_COUNT] = {"best", "first", "next", "address"};
+
+// The policy to start with, unless MY_PLACEMENT in the environment names
+// another. Build with PLACEMENT=FIRST and so on to change it
+#ifndef PLACEMENT_DEFAULT
+#define PLACEMENT_DEFAULT PLACE_BEST
+#endif
+
+static bool placement_chosen;  // set once the environment has been read
+
+// Handles. Each handle block starts with a hidden word holding its handle,
+// padded to ALIGNMENT so the data after it stays aligned; that word is how
+// my_compact finds the slot to update when it moves the block. The slots
+// live in a mapping of their own and are recycled through a free chain.
+#define HANDLE_TAG_SIZE ALIGNMENT
+
+typedef struct handle_slot_t {
+  union {
+    uint8_t * ptr;  // data of a live handle
+    size_t next;    // next free slot, 0 ends the chain
+  };
+  size_t locks;
+} handle_slot_t;
+
+// Segments. Once mem_sbrk runs out the heap carries on in segments mapped
+// apart from it. A segment starts with its registry entry, then a size 0
+// in use block (header and footer) standing in for a left neighbour, then
+// the blocks themselves, and ends with a size 0 in use header standing in
+// for a right neighbour. Nothing ever coalesces across these sentinels, so
+// none of the block code has to know where one segment stops.
+typedef struct segment_t {
+  struct segment_t * next;
+  uint8_t * end;  // the closing sentinel
+  size_t len;     // length of the mapping
+} segment_t;
+
+// Offset of the first block, chosen so that its payload stays aligned
+#define SEGMENT_FIRST (ALIGN(sizeof(segment_t) + TAGS_SIZE + offsetof(header_t, next)) - \
+                       offsetof(header_t, next))
+
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE (1 << 20)
+#endif
 
-int free_list_max;
+// A heap, and everything the allocator keeps about it. The default heap,
+// the one behind my_malloc, grows through mem_sbrk and into segments; an
+// instance made by my_heap_create or my_heap_create_in_buffer lives at the
+// start of its own memory and grows by moving its closing sentinel (a size
+// 0 in use header, as at the end of a segment) up towards end. Every
+// internal function is handed the heap it works on: the my_ calls pass the
+// default heap, and the my_heap_ calls the instance they were given.
+struct my_heap_t {
+  header_t * free_lists[LIST_SIZE];
+  int free_list_max;
+
+  // Free blocks inside short-lived chunks, binned the same way. Keeping them
+  // apart stops a load spike of temporaries from leaving long-lived blocks
+  // pinned between its holes.
+  header_t * short_lists[LIST_SIZE];
+  int short_list_max;
+
+  // Where next fit carries on from: the block after the last one it took.
+  // remove_free_list_address moves it along when that block is taken
+  header_t * rover;
+
+  placement_t placement;  // how malloc picks among the free blocks that fit
+
+  // The blocks run from lo up to brk. For the default heap brk follows
+  // memlib's break; for an instance it is the closing sentinel
+  uint8_t * lo;
+  uint8_t * brk;
+  uint8_t * end;     // the first byte past an instance's memory
+  size_t map_len;    // length of the mapping to give back, 0 for a buffer
+
+  // Set by malloc_block when the block it returned was carved from memory
+  // that was never handed out before, so its payload is known to be zero
+  bool fresh_block;
+
+  // The rest is only used in the default heap
+  segment_t * segments;          // every segment, newest first
+
+  handle_slot_t * handle_slots;  // slot 0 is never handed out
+  size_t handle_bytes;           // length of the mapping
+  size_t handle_count;           // slots ever handed out, plus slot 0
+  size_t handle_free;            // head of the free chain
+
+#ifdef NURSERY
+  unsigned nursery_epoch;        // see nursery
+#endif
+#ifdef DENSE_SMALL
+  dense_t * dense[DENSE_CLASSES];  // slabs with room, by object stride
+#endif
+#ifdef DECAY_PURGE
+  unsigned purge_ticks;          // my_free calls since the last purge
+#endif
+#ifdef BACKGROUND_MAINTENANCE
+  header_t * deferred;           // blocks freed but not yet merged, through next
+#endif
+#ifdef SIDE_METADATA
+  uint64_t * meta_starts;        // bit set on the first granule of a free block
+  uint64_t * meta_ends;          // bit set on the last granule of a free block
+  size_t meta_bytes;             // length of each bitmap mapping
+  uint8_t * meta_base;           // address of granule 0, the first header
+#endif
+};
 
-header_t * free_lists[LIST_SIZE]; 
+static my_heap_t default_heap = {.placement = PLACEMENT_DEFAULT};
 
 // Method finds the appropriate free_list index for a given size
 static inline int calculate_hash(const size_t size);
 
+// Allocate from chunks set apart from the main heap (see my_malloc_hint)
+static void * malloc_chunked(my_heap_t * h, const size_t size);
+
+// Grow the heap by size bytes, returning NULL if there is no room
+static inline void * my_allocator(my_heap_t * h, const size_t size);
+
+// Find or sbrk a block for size bytes, without any placement constraint
+static inline void * malloc_block(my_heap_t * h, const size_t size);
+
+#ifdef CACHE_LINE_PLACEMENT
+// Allocate size bytes with the payload on a cache line boundary
+static void * malloc_on_line(my_heap_t * h, const size_t size);
+#endif
+
+#ifdef NURSERY
+// Bump-allocate a small block from this thread's nursery chunk (see
+// nursery_t), and give one back
+static inline void * nursery_malloc(const size_t size);
+static void nursery_free(header_t * header);
+
+// Move the unlocked handle blocks out of nursery chunks and into the main
+// heap, where my_compact can slide them, and give back this thread's
+// chunk if nothing is left in it
+static void nursery_evacuate(void);
+#endif
+
+#ifdef DENSE_SMALL
+// Take an object of size bytes from a slab of its class, and give one back
+static inline void * dense_malloc(my_heap_t * h, const size_t size);
+static void dense_free(my_heap_t * h, header_t * header);
+
+// Move the unlocked handle blocks out of slabs, as nursery_evacuate does,
+// and give back the slabs that are left empty
+static void dense_evacuate(my_heap_t * h);
+#endif
+
 // Calculate MSB for a specific size
 static inline int calculate_hash(const size_t size);
 
 // If you are allocating a size that is less than it's container, add the difference to a free_list bin
-void * free_remaining_memory(const void * p, const size_t free_list_size, const size_t aligned_size);
+void * free_remaining_memory(my_heap_t * h, const void * p, const size_t free_list_size, const size_t aligned_size);
 
-// Merge to free lists together to create a larger chunk of free memory
-header_t * coalesce(const void * ptr);
+// Merge to free lists together to create a larger chunk of free memory.
+// Only neighbours of the same lifetime class (short_lived or not) are merged
+header_t * coalesce(my_heap_t * h, const void * ptr, const bool short_lived);
 
 // This free_list_addresss is no longer free/ or has a different size. Remove it from the appropriate bin
-void remove_free_list_address(header_t * hdr_ptr);
+void remove_free_list_address(my_heap_t * h, header_t * hdr_ptr);
 
 // Once we find a block of memory that fits what we need, check a couple more bins to see if we can find a better fit
 header_t * get_best_block(const size_t size, header_t * best_block);
 
+// Shrink an in use block to stored_size and give the rest back to a free_list bin
+static inline void split_block(my_heap_t * h, header_t * header, const size_t stored_size);
+
+// Push a free block onto its bin as it is, without coalescing
+static inline void insert_free_block(my_heap_t * h, header_t * header, const bool short_lived);
+
+// First free block in lists with at least size bytes of payload. The block stays on its list
+static header_t * find_free_block(header_t ** lists, const int list_max, const size_t size);
+
+// A free block from the free_lists with at least size bytes of payload,
+// chosen by the placement policy, or NULL. The block stays on its list
+static inline header_t * place_block(my_heap_t * h, const size_t size, const int sig_bit);
+
+// Grow the last block of the heap in place to stored_size by moving the
+// break. Returns false if it is not the last block or the heap cannot grow
+static bool grow_at_top(my_heap_t * h, header_t * header, const size_t stored_size);
+
+// Sort an array of pointers by address, in place
+static void sort_pointers(void ** ptrs, const size_t n);
+
+// my_free_batch on ptrs already sorted by address
+static void free_sorted(void ** ptrs, const size_t n);
+
+// Give a large request pages of its own, with the payload aligned to alignment
+static void * map_block(const size_t size, const size_t alignment);
+
+// Return the pages of a mapped block
+static void unmap_block(header_t * header);
+
+// Grow or shrink a mapped block by remapping its pages
+static void * remap_block(header_t * header, const size_t size);
+
 bool free_availible;
 
+// Take a slot off the free chain, growing the table if it is empty
+static my_handle_t handle_new(my_heap_t * h);
+
+// The slot of a live handle block, or NULL if header is any other block
+static inline handle_slot_t * handle_of(const my_heap_t * h, const header_t * header);
+
+// Turn the bytes in [start, end) into one free block of the given class
+static inline void free_gap(my_heap_t * h, uint8_t * start, const uint8_t * end, const bool short_lived);
+
+// Compact the blocks in [p, hi) for my_compact. Returns where the free space
+// left at the top of the range starts, or NULL if it ends in a block, and
+// sets gap_short to that space's lifetime class
+static uint8_t * compact_range(my_heap_t * h, uint8_t * p, const uint8_t * hi, bool * gap_short);
+
+// The second half of my_free, for blocks that are known to be in the heap
+static void release_block(my_heap_t * h, header_t * header);
+
+// Lay a heap instance out at the start of the len bytes at mem
+static my_heap_t * heap_format(uint8_t * mem, const size_t len);
+
+// The first block of a heap instance, just past its state and sentinels
+static inline uint8_t * heap_first(const my_heap_t * h);
+
+// Whether every block on h's bins is free and of the bin's lifetime class
+static bool check_bins(const my_heap_t * h);
+
+// Map a segment with room for a size byte block at its start and return
+// that block, in use. The rest of the segment goes onto the free_lists
+static void * segment_new(my_heap_t * h, const size_t size);
+
+// my_allocator, falling back to a new segment when the heap cannot grow
+static void * heap_grow(my_heap_t * h, const size_t size);
+
+#ifdef DECAY_PURGE
+// Decay purging. A free block of at least PURGE_MIN_SIZE remembers when it
+// went onto its bin. Once it has sat there for PURGE_DECAY_MS, the whole
+// pages between its tag and its footer are handed back to the kernel. The
+// header, links, tag and footer stay resident, so the block needs no
+// repair when it is reused: the purged pages fault back in as it is written.
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 1000
+#endif
+#define PURGE_MIN_SIZE (64 * 1024)
+
+// my_free calls between looks at the large bins
+#define PURGE_TICKS 256
+
+typedef struct purge_tag_t {
+  uint64_t freed_ms;  // when the block went onto its bin
+  uint64_t purged;    // nonzero once its pages have been handed back
+} purge_tag_t;
+
+// The tag sits right after a free block's links
+#define purge_tag(header) ((purge_tag_t *)((uint8_t *)(header) + HEADER_T_SIZE))
+
+// Milliseconds on a clock that is cheap to read
+static inline uint64_t purge_clock(void);
+
+// Purge every large free block that has been idle for decay_ms, and return
+// the number of bytes handed back
+static size_t purge_blocks(my_heap_t * h, const unsigned decay_ms);
+#endif
+
+#ifdef BACKGROUND_MAINTENANCE
+// Background maintenance. While the thread runs, my_free only pushes the
+// block, still marked in use, onto the deferred list; the thread later
+// frees those blocks properly (merging them with their neighbours), gives
+// a large free block at the top of the heap back to memlib, and sorts the
+// bins smallest first. The allocator is still meant
+// for one application thread, and the two sides keep out of each other's
+// way with a pair of flags instead of a lock: the foreground raises fg_busy
+// and waits for bg_active to drop, and the thread backs off between steps
+// as soon as it sees fg_busy.
+static pthread_t maint_thread;
+static bool maint_running;     // foreground only: the thread exists
+static unsigned maint_interval; // microseconds between passes
+static bool maint_stop_flag;   // asks the thread to exit, under maint_lock
+static pthread_mutex_t maint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_wake = PTHREAD_COND_INITIALIZER;
+static int fg_busy;            // the foreground is inside the allocator
+static int bg_active;          // the thread is touching the heap
+static int maint_depth;        // foreground only: nesting of entry points
+
+// A free block at the top of the heap at least this big is given back
+#define MAINT_TRIM_THRESHOLD MMAP_THRESHOLD
+
+// Mark the foreground busy until the end of the enclosing function
+#define MAINT_GUARD() \
+  int maint_guard_ __attribute__((cleanup(maint_leave), unused)) = maint_enter()
+
+static inline int maint_enter(void);
+static inline void maint_leave(int * guard);
+
+// Free the blocks on the deferred list for real. When yield is set, stop
+// early if the foreground wants in. Returns false if it stopped early.
+static bool maint_drain(my_heap_t * h, const bool yield);
+
+// Give a large free block at the top of the heap back to memlib
+static void maint_trim(my_heap_t * h);
+
+// Sort each bin by size, so the first block that fits is the best fit
+static void maint_sort_bins(my_heap_t * h, const bool yield);
+
+static void * maint_main(void * arg);
+#else
+#define MAINT_GUARD() do { } while (0)
+#endif
+
+#ifdef SIDE_METADATA
+// Out-of-line metadata. The heap is cut into ALIGNMENT-byte granules,
+// counted from the first header, and two bitmaps kept in pages of their
+// own mark the first and the last granule of every free block. coalesce
+// finds its free neighbours (and their extent) from the bitmaps alone, so
+// an in use neighbour is never touched, and a stray write past the end of
+// a payload cannot make a block look free. The bitmaps grow with the
+// heap, a page at a time, ahead of every sbrk. They live in my_heap_t.
+
+// Granule index of a heap address
+#define granule(h, p) ((size_t)((uint8_t *)(p) - (h)->meta_base) / ALIGNMENT)
+
+// Address of a granule
+#define granule_addr(h, g) ((h)->meta_base + (g) * ALIGNMENT)
+
+#define meta_test(map, g) (((map)[(g) / 64] >> ((g) % 64)) & 1)
+#define meta_set(map, g) ((map)[(g) / 64] |= (uint64_t)1 << ((g) % 64))
+#define meta_clear(map, g) ((map)[(g) / 64] &= ~((uint64_t)1 << ((g) % 64)))
+
+// The bitmaps cover the range mem_sbrk hands out and nothing else. Blocks
+// in segments and in heap instances (even one carved from a block of the
+// default heap) keep to their boundary tags
+#define meta_covers(h, p) ((h) == &default_heap && (uint8_t *)(p) >= (h)->meta_base && \
+                           (uint8_t *)(p) < (h)->brk)
+
+// Make the bitmaps cover the heap up to hi. Returns false if they cannot
+static bool meta_cover(my_heap_t * h, const void * hi);
+
+// Shrink the bitmaps back to bytes long
+static void meta_trim(my_heap_t * h, const size_t bytes);
+
+// Record that header is now a free block, or no longer is one
+static inline void meta_mark_free(my_heap_t * h, const header_t * header);
+static inline void meta_mark_used(my_heap_t * h, const header_t * header);
+
+// The nearest set bit at or below / at or above g
+static size_t meta_prev_set(const uint64_t * map, size_t g);
+static size_t meta_next_set(const my_heap_t * h, const uint64_t * map, size_t g);
+#endif
+
 // check - This checks our invariant that the size_t header before every
 // block points to either the beginning of the next block, or the end of the
 // heap.
 int my_check() {
+  MAINT_GUARD();
+  my_heap_t * h = &default_heap;
   char *p;
   char *lo = (char*)mem_heap_lo();
   char *hi = (char*)mem_heap_hi() + 1;
   size_t size = 0;
   size_t p_size;
 
-  p = lo;
+  if ((char *)h->lo != lo + HEAP_PAD || (char *)h->brk != hi) {
+    printf("The heap's bounds have lost track of memlib's break!\n");
+    printf("heap_lo: %p, heap_hi: %p, lo: %p, brk: %p\n", lo, hi, h->lo, h->brk);
+    return -1;
+  }
+
+  p = lo + HEAP_PAD;
   while (lo <= p && p < hi) {
     header_t * header = (header_t *)p;
     p_size = get_size(header);
@@ -143,6 +686,68 @@ int my_check() {
     return -1;
   }
 
+  // Each segment is walked the same way, from its first block to its
+  // closing sentinel
+  for (segment_t * segment = h->segments; segment != NULL; segment = segment->next) {
+    uint8_t * first = (uint8_t *)segment + SEGMENT_FIRST;
+    if (((header_t *)(first - TAGS_SIZE))->size != 0 ||
+        ((footer_t *)(first - FOOTER_T_SIZE))->size != 0 ||
+        ((header_t *)segment->end)->size != 0) {
+      printf("Segment %p has lost its sentinels!\n", (void *)segment);
+      return -1;
+    }
+    uint8_t * q = first;
+    while (q < segment->end) {
+      q += get_size((header_t *)q) + TAGS_SIZE;
+    }
+    if (q != segment->end) {
+      printf("Bad headers did not end at the end of segment %p!\n", (void *)segment);
+      printf("first: %p, end: %p, p: %p\n", first, segment->end, q);
+      return -1;
+    }
+  }
+
+  if (!check_bins(h)) {
+    return -1;
+  }
+
+#ifdef DENSE_SMALL
+  // A listed slab has room for one more object of its class
+  for (size_t i = 0; i < DENSE_CLASSES; i++) {
+    for (dense_t * c = h->dense[i]; c != NULL; c = c->next) {
+      if (!c->listed || c->stride != i * ALIGNMENT ||
+          (c->free == NULL && c->stride > (size_t)(c->end - c->cur))) {
+        printf("Slab %p is on the wrong list!\n", (void *)c);
+        return -1;
+      }
+    }
+  }
+#endif
+
+#ifdef SIDE_METADATA
+  // Every free block has its two bits, and no other bits are set
+  size_t free_blocks = 0;
+  for (p = lo + HEAP_PAD; p < hi; p += get_size((header_t *)p) + TAGS_SIZE) {
+    header_t * header = (header_t *)p;
+    const size_t first = granule(h, header);
+    const size_t last = granule(h, p + get_size(header) + TAGS_SIZE) - 1;
+    if (meta_test(h->meta_starts, first) != (is_free(header) != 0) ||
+        meta_test(h->meta_ends, last) != (is_free(header) != 0)) {
+      printf("Metadata bitmap disagrees with the block at %p\n", p);
+      return -1;
+    }
+    free_blocks += (is_free(header) != 0);
+  }
+  size_t bits = 0;
+  for (size_t i = 0; i < h->meta_bytes / sizeof(uint64_t); i++) {
+    bits += __builtin_popcountl(h->meta_starts[i]) + __builtin_popcountl(h->meta_ends[i]);
+  }
+  if (bits != 2 * free_blocks) {
+    printf("Metadata bitmap has %zu bits set for %zu free blocks\n", bits, free_blocks);
+    return -1;
+  }
+#endif
+
   return 0;
 }
 
@@ -150,115 +755,459 @@ int my_check() {
 // calls are made.  Since this is a very simple implementation, we just
 // return success.
 inline int my_init() {
+  MAINT_GUARD();
+  my_heap_t * h = &default_heap;
   // Set all of the free_list HEADS to NULL initially
   for (int i=0; i < LIST_SIZE; i++) {
-    free_lists[i] = NULL;
+    h->free_lists[i] = NULL;
+  }
+  h->free_list_max = 0;
+  for (int i = 0; i < LIST_SIZE; i++) {
+    h->short_lists[i] = NULL;
+  }
+  h->short_list_max = 0;
+  h->rover = NULL;
+  if (!placement_chosen) {
+    const char * name = getenv("MY_PLACEMENT");
+    if (name != NULL && my_placement_set(name) < 0) {
+      fprintf(stderr, "MY_PLACEMENT: no policy called %s\n", name);
+    }
+    placement_chosen = true;
+  }
+  // mem_reset_brk unmapped the handle table and the segments too
+  h->handle_slots = NULL;
+  h->handle_bytes = h->handle_count = h->handle_free = 0;
+  h->segments = NULL;
+#ifdef NURSERY
+  // Every thread's nursery chunk went with the old heap
+  h->nursery_epoch++;
+#endif
+#ifdef DENSE_SMALL
+  // The slabs went with the old heap
+  memset(h->dense, 0, sizeof(h->dense));
+#endif
+#ifdef BACKGROUND_MAINTENANCE
+  // Nothing is left to merge in an empty heap
+  __atomic_store_n(&h->deferred, NULL, __ATOMIC_RELAXED);
+#endif
+
+  // The blocks start where memlib's break is now
+  h->lo = (uint8_t *)mem_heap_lo() + HEAP_PAD;
+  h->brk = (uint8_t *)mem_heap_hi() + 1;
+#ifdef SIDE_METADATA
+  // mem_reset_brk took the old bitmaps along with the rest of the heap
+  h->meta_starts = h->meta_ends = NULL;
+  h->meta_bytes = 0;
+  h->meta_base = h->lo;
+#endif
+
+  // Push the first block out so that its payload is aligned
+  assert(((uintptr_t)mem_heap_lo() % ALIGNMENT) == 0);
+  if (HEAP_PAD > 0 && mem_heapsize() == 0 && my_allocator(h, HEAP_PAD) == NULL) {
+    return -1;
   }
-  free_list_max = 0;
   return 0;
 }
 
-inline void * my_allocator(const size_t size) {
+static inline void * my_allocator(my_heap_t * h, const size_t size) {
   // Expands the heap by the given number of bytes and returns a pointer to
   // the newly-allocated area. This is a slow call, so you will want to
   // make sure you don't wind up calling it on every malloc
-  void *p = mem_sbrk(size);
+  if (size > INTPTR_MAX) {
+    return NULL;
+  }
+  if (h != &default_heap) {
+    // The new space starts where the closing sentinel was
+    if (size > (size_t)(h->end - h->brk) - sizeof(header_t *)) {
+      return NULL;
+    }
+    uint8_t * p = h->brk;
+    h->brk += size;
+    ((header_t *)h->brk)->size = 0;
+    return p;
+  }
+#ifdef SIDE_METADATA
+  const size_t covered = h->meta_bytes;
+  if (!meta_cover(h, h->brk + size)) {
+    return NULL;
+  }
+#endif
+  // Running out here is not an error yet: heap_grow has segments to try,
+  // and realloc is only asking whether the block can grow in place
+  void *p = mem_sbrk_try((intptr_t)size);
 
-  if (p == (void *)-1) {
+  if (p == NULL) {
+#ifdef SIDE_METADATA
+    // Do not keep bitmaps for a heap we did not get
+    meta_trim(h, covered);
+#endif
     // Some sort of error occurred. We return NULL to let
     // the client code know that we weren't able to allocate memory
     return NULL;
   }
+  h->brk = (uint8_t *)p + size;
+  return p;
+}
+
+#ifdef NURSERY
+// nursery_refill - Make room for more blocks: start the current chunk over
+// if nothing in it is live, or else retire it and take a new one. Returns
+// false if the heap has no room for a new chunk.
+static bool nursery_refill(void) {
+  nursery_t * c = (nursery.epoch == default_heap.nursery_epoch) ? nursery.chunk : NULL;
+  if (c != NULL && c->live > 0) {
+    c->retired = true;
+    c = NULL;
+  }
+  if (c == NULL) {
+    c = (nursery_t *)malloc_block(&default_heap, NURSERY_CHUNK);
+    if (c == NULL) {
+      return false;
+    }
+    c->live = 0;
+    c->retired = false;
+    nursery.chunk = c;
+    nursery.end = (uint8_t *)c + my_malloc_usable_size(c);
+    nursery.epoch = default_heap.nursery_epoch;
+  }
+  nursery.cur = (uint8_t *)c + NURSERY_FIRST;
+  return true;
+}
+
+static inline void * nursery_malloc(const size_t size) {
+  const size_t stride = ALIGN(size + (size == 0) + offsetof(header_t, next));
+  if (nursery.epoch != default_heap.nursery_epoch || stride > (size_t)(nursery.end - nursery.cur)) {
+    if (!nursery_refill()) {
+      return NULL;
+    }
+  }
+  header_t * header = (header_t *)nursery.cur;
+  header->size = ((size_t)(nursery.cur - (uint8_t *)nursery.chunk) << 32) |
+                 (stride - offsetof(header_t, next)) | NURSERY_TAG;
+  nursery.cur += stride;
+  nursery.chunk->live++;
+  return (uint8_t *)header + offsetof(header_t, next);
+}
+
+static void nursery_free(header_t * header) {
+  nursery_t * c = nursery_of(header);
+  assert(c->live > 0);
+  if (--c->live > 0) {
+    return;
+  }
+  if (c->retired) {
+    my_free(c);
+  } else if (c == nursery.chunk) {
+    nursery.cur = (uint8_t *)c + NURSERY_FIRST;
+  }
+}
+
+static void nursery_evacuate(void) {
+  my_heap_t * h = &default_heap;
+  for (size_t handle = 1; handle < h->handle_count; handle++) {
+    handle_slot_t * slot = &h->handle_slots[handle];
+    // A free slot holds a small index, never a heap address
+    if ((uintptr_t)slot->ptr < h->handle_count || slot->locks > 0) {
+      continue;
+    }
+    uint8_t * data = slot->ptr - HANDLE_TAG_SIZE;
+    header_t * header = (header_t *)(data - offsetof(header_t, next));
+    if (!is_nursery(header)) {
+      continue;
+    }
+    const size_t size = nursery_size(header);
+    uint8_t * p = (uint8_t *)malloc_block(h, size);
+    if (p == NULL) {
+      return;
+    }
+    memcpy(p, data, size);
+    slot->ptr = p + HANDLE_TAG_SIZE;
+    nursery_free(header);
+  }
+
+  // An empty chunk would stand in the way of everything above it
+  if (nursery.epoch == h->nursery_epoch && nursery.chunk != NULL &&
+      nursery.chunk->live == 0) {
+    my_free(nursery.chunk);
+    nursery.chunk = NULL;
+    nursery.cur = nursery.end = NULL;
+  }
+}
+#endif
+
+#ifdef DENSE_SMALL
+// dense_unlist - Take c off its class's list of slabs with room
+static void dense_unlist(my_heap_t * h, dense_t * c) {
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    h->dense[c->stride / ALIGNMENT] = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  c->listed = false;
+}
+
+// dense_grow - Put a new slab for objects of stride bytes at the head of
+// its class's list. Returns NULL if the heap has no room for one.
+static dense_t * dense_grow(my_heap_t * h, const size_t stride) {
+  dense_t * c = (dense_t *)malloc_block(h, DENSE_CHUNK);
+  if (c == NULL) {
+    return NULL;
+  }
+  dense_t ** head = &h->dense[stride / ALIGNMENT];
+  c->prev = NULL;
+  c->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = c;
+  }
+  *head = c;
+  c->free = NULL;
+  c->cur = (uint8_t *)c + DENSE_FIRST;
+  c->end = (uint8_t *)c + get_size((header_t *)((uint8_t *)c - offsetof(header_t, next)));
+  c->live = 0;
+  c->stride = stride;
+  c->listed = true;
+  return c;
+}
+
+static inline void * dense_malloc(my_heap_t * h, const size_t size) {
+  const size_t stride = DENSE_STRIDE(size);
+  dense_t * c = h->dense[stride / ALIGNMENT];
+  if (c == NULL && (c = dense_grow(h, stride)) == NULL) {
+    return NULL;
+  }
+  uint8_t * p = (uint8_t *)c->free;
+  if (p != NULL) {
+    c->free = *(void **)p;
+  } else {
+    header_t * header = (header_t *)c->cur;
+    header->size = ((size_t)(c->cur - (uint8_t *)c) << 32) |
+                   (stride - offsetof(header_t, next)) | DENSE_TAG;
+    c->cur += stride;
+    p = (uint8_t *)header + offsetof(header_t, next);
+  }
+  c->live++;
+  if (c->free == NULL && stride > (size_t)(c->end - c->cur)) {
+    // Full: the next request of this class looks at the next slab
+    dense_unlist(h, c);
+  }
   return p;
 }
 
+static void dense_free(my_heap_t * h, header_t * header) {
+  dense_t * c = dense_of(header);
+  void * p = (uint8_t *)header + offsetof(header_t, next);
+  assert(c->live > 0);
+  *(void **)p = c->free;
+  c->free = p;
+  c->live--;
+  if (!c->listed) {
+    dense_t ** head = &h->dense[c->stride / ALIGNMENT];
+    c->prev = NULL;
+    c->next = *head;
+    if (*head != NULL) {
+      (*head)->prev = c;
+    }
+    *head = c;
+    c->listed = true;
+  }
+  if (c->live == 0 && (c->prev != NULL || c->next != NULL)) {
+    // Keep one slab of the class around, so that a class that empties and
+    // fills again does not take a new one each time
+    dense_unlist(h, c);
+    release_block(h, (header_t *)((uint8_t *)c - offsetof(header_t, next)));
+  }
+}
+
+static void dense_evacuate(my_heap_t * h) {
+  for (size_t handle = 1; handle < h->handle_count; handle++) {
+    handle_slot_t * slot = &h->handle_slots[handle];
+    // A free slot holds a small index, never a heap address
+    if ((uintptr_t)slot->ptr < h->handle_count || slot->locks > 0) {
+      continue;
+    }
+    uint8_t * data = slot->ptr - HANDLE_TAG_SIZE;
+    header_t * header = (header_t *)(data - offsetof(header_t, next));
+    if (!is_dense(header)) {
+      continue;
+    }
+    const size_t size = dense_size(header);
+    uint8_t * p = (uint8_t *)malloc_block(h, size);
+    if (p == NULL) {
+      return;
+    }
+    memcpy(p, data, size);
+    slot->ptr = p + HANDLE_TAG_SIZE;
+    dense_free(h, header);
+  }
+
+  // Empty slabs would stand in the way of everything above them
+  for (size_t i = 0; i < DENSE_CLASSES; i++) {
+    dense_t * c = h->dense[i];
+    while (c != NULL) {
+      dense_t * next = c->next;
+      if (c->live == 0) {
+        dense_unlist(h, c);
+        release_block(h, (header_t *)((uint8_t *)c - offsetof(header_t, next)));
+      }
+      c = next;
+    }
+  }
+}
+#endif
+
 //  malloc - Allocate a block by incrementing the brk pointer.
 //  Always allocate a block whose size is a multiple of the alignment.
-inline void * my_malloc(const size_t size) {
+//  Flattened, like my_free, so that the default heap is a constant all the
+//  way down instead of an argument to an out-of-line malloc_block.
+inline __attribute__((flatten)) void * my_malloc(const size_t size) {
+  MAINT_GUARD();
+#ifdef NURSERY
+  if (size <= NURSERY_MAX) {
+    return nursery_malloc(size);
+  }
+#endif
+#ifdef DENSE_SMALL
+  if (size <= DENSE_MAX) {
+    return dense_malloc(&default_heap, size);
+  }
+#endif
+#ifdef CACHE_LINE_PLACEMENT
+  if (size >= CACHE_LINE_SIZE && size < MMAP_THRESHOLD - CACHE_LINE_SIZE) {
+    return malloc_on_line(&default_heap, size);
+  }
+#endif
+  return malloc_block(&default_heap, size);
+}
+
+// malloc_hint - Allocate size bytes, placed according to how long the
+// caller expects them to live. Short-lived blocks are carved from chunks
+// of their own, so that they do not leave holes between long-lived ones
+// when they go away. Long-lived and unhinted requests share the main heap.
+void * my_malloc_hint(size_t size, unsigned hint) {
+  MAINT_GUARD();
+#ifdef NURSERY
+  // Small blocks known to stay would only pin nursery chunks
+  if (size <= NURSERY_MAX) {
+    return (hint & MY_HINT_LONG_LIVED) ? malloc_block(&default_heap, size) : nursery_malloc(size);
+  }
+#endif
+#ifdef DENSE_SMALL
+  // Small blocks known to go away soon would leave holes in the slabs
+  if (size <= DENSE_MAX) {
+    return (hint & MY_HINT_SHORT_LIVED) ? malloc_chunked(&default_heap, size)
+                                        : dense_malloc(&default_heap, size);
+  }
+#endif
+  if (!(hint & MY_HINT_SHORT_LIVED) || size >= MMAP_THRESHOLD) {
+    return my_malloc(size);
+  }
+  return malloc_chunked(&default_heap, size);
+}
+
+// malloc_chunked - Allocate size bytes (below MMAP_THRESHOLD) from the
+// segregated chunks on short_lists
+static void * malloc_chunked(my_heap_t * h, const size_t size) {
+  size_t stored_size = ALIGN_PAYLOAD(size);
+  if (size < FREE_HEADER_SIZE) {
+    stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+  }
+
+  header_t * header = find_free_block(h->short_lists, h->short_list_max, stored_size);
+#ifdef BACKGROUND_MAINTENANCE
+  if (header == NULL && h->deferred != NULL) {
+    // The space may be sitting on the deferred list: free it before
+    // starting a new chunk
+    maint_drain(h, false);
+    header = find_free_block(h->short_lists, h->short_list_max, stored_size);
+  }
+#endif
+  if (header != NULL) {
+    remove_free_list_address(h, header);
+    set_in_use(header);
+  } else {
+    // Start a new chunk. It is an ordinary block until it is marked
+    const size_t chunk = (stored_size + TAGS_SIZE > SHORT_CHUNK) ? stored_size : SHORT_CHUNK - TAGS_SIZE;
+    uint8_t * p = (uint8_t *)malloc_block(h, chunk);
+    if (p == NULL) {
+      return NULL;
+    }
+    header = (header_t *)(p - offsetof(header_t, next));
+  }
+  header->size |= SHORT_BIT;
+
+  if (get_size(header) - stored_size >= FREE_HEADER_SIZE + SPLIT_CONSTANT + TAGS_SIZE) {
+    split_block(h, header, stored_size);
+  }
+  return (uint8_t *)header + offsetof(header_t, next);
+}
+
+// malloc_block - The allocator proper: find (or sbrk) a block for size bytes
+// wherever it happens to fall
+static inline void * malloc_block(my_heap_t * h, const size_t size) {
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (size >= MMAP_THRESHOLD && h == &default_heap) {
+    // Fresh pages from the kernel are zero
+    h->fresh_block = true;
+    return map_block(size, ALIGNMENT);
+  }
   // We allocate a little bit of extra memory so that we can store the
   // size of the block we've allocated.  Take a look at realloc to see
   // one example of a place where this can come in handy.
-  size_t stored_size = ALIGN(size);
+  size_t stored_size = ALIGN_PAYLOAD(size);
   if (size < FREE_HEADER_SIZE) {
      // To ensure our allocation doesn't break, allocate a little extra space if size < FREE_LIST_SIZE
-     stored_size = FREE_HEADER_SIZE;
+     stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
   }
-  const size_t aligned_size = ALIGN(stored_size + offsetof(header_t, next) + FOOTER_T_SIZE);
+  const size_t aligned_size = stored_size + TAGS_SIZE;
 
   const int sig_bit = calculate_hash(stored_size);
-  const int allocation_power = sig_bit + 1; // Allocate the power of two that is just greater than our size
   
-  assert(allocation_power < LIST_SIZE);
+  assert(sig_bit < LIST_SIZE);
   
   void * p = NULL;
   header_t * header;
   footer_t * footer;
 
-  // Linear search the free_lists
-  if (free_lists[sig_bit] != NULL) {
-    // Check to see if the first block in the appropriate free_list can fit the block we want to allocate
-    if (get_size(free_lists[sig_bit]) >= stored_size) {
-      header_t * best_block = get_best_block(stored_size, free_lists[sig_bit]);
-      p = (void *)(best_block);
-      stored_size = get_size(best_block);
-      remove_free_list_address(best_block);
-    } else {
-      // Iterate through the linked list of the appropriate size to see if we can find a block big enough for us to allocate too.
-      header_t * free_pointer = free_lists[sig_bit];
-      header_t * free_pointer2 = free_lists[sig_bit]->next;
-      while (free_pointer2 != NULL) {
-        if (get_size(free_pointer2) >= stored_size) {
-          // If this condition is met, you have found a free list spot to allocate to
-          header_t * best_block = get_best_block(stored_size, free_pointer2);
-          p = (void *)(best_block); 
-          stored_size = get_size(best_block);
-          remove_free_list_address(best_block);
-          break;
-        }
-        free_pointer = free_pointer->next;
-        free_pointer2 = free_pointer2->next;
-      }
-    }
-  } 
- 
-  size_t free_list_size;
-  // If we didn't find anything in our linear search, look at the larger bins
-  if (p == NULL) {
-    for (int i = allocation_power; i <= free_list_max; i++) {
-      // Check to see if there is any blocks of memory in this free list
-      if (free_lists[i] != NULL) {
-        // Find a good fitting block for this size
-        header_t * best_block = get_best_block(stored_size, free_lists[i]);
-        p = (void *)(best_block);
-        // Check to see if you have a good amount of extra memory. If you do, add the extra memory to a seperate free memory bin.
-        if ((aligned_size <= get_size(best_block)) && (get_size(best_block) - aligned_size) >= FREE_HEADER_SIZE + SPLIT_CONSTANT) {
-          assert(aligned_size <= get_size(best_block));
-          free_list_size = get_size(best_block);
-          remove_free_list_address(p);
-
-          header = (header_t *)p;
-          set_size(stored_size, header);
-          set_in_use(header);
-          footer = (footer_t *)((uint8_t *) p + offsetof(header_t, next) + stored_size);
-          footer->size = stored_size;
-          // assert(header->size == ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + header->size))->size);
-          free_remaining_memory(p, free_list_size, aligned_size);
-        } else { //This block is a pretty tight fit, just use all of it
-          stored_size = get_size(best_block);
-          remove_free_list_address(p);
-        } // Could freeing extra memory mess with this next call?
-        break;
-      }
+  header_t * block = place_block(h, stored_size, sig_bit);
+  if (block != NULL) {
+    p = (void *)block;
+    remove_free_list_address(h, block);
+    // Check to see if you have a good amount of extra memory. If you do, add the extra memory to a seperate free memory bin.
+    if (calculate_hash(get_size(block)) > sig_bit && aligned_size <= get_size(block) &&
+        get_size(block) - aligned_size >= FREE_HEADER_SIZE + SPLIT_CONSTANT) {
+      header = block;
+      set_in_use(header);
+      split_block(h, header, stored_size);
+    } else { //This block is a pretty tight fit, just use all of it
+      stored_size = get_size(block);
     }
+  } else {
     // If this condition is met, we couldn't find an appropriate free spot. Call my_allocator
     // To make the call to mem_sbrk to get additional memory
+#ifdef BACKGROUND_MAINTENANCE
+    if (h->deferred != NULL) {
+      // Free what the thread has not got to yet before growing the heap
+      maint_drain(h, false);
+      return malloc_block(h, size);
+    }
+#endif
+    void * clean = mem_heap_clean();
+    p = heap_grow(h, aligned_size);
+    // None of our allocation methods were successful. Return NULL as a result
     if (p == NULL) {
-      p = my_allocator(aligned_size);
-      // None of our allocation methods were successful. Return NULL as a result
-      if (p == NULL) {
-        return NULL;
-      }
+      return NULL;
     }
+    // A segment below the heap is as freshly mapped as one above it. An
+    // instance never gives memory back, so what it grows into is as fresh
+    // as its pages, unless it is in a buffer that was never zeroed
+    h->fresh_block = (h == &default_heap)
+        ? ((char *)p >= (char *)clean || (char *)p < (char *)mem_heap_lo())
+        : (h->map_len != 0);
   }
 /*  
   // If this condition is met, we couldn't find an appropriate free spot. Call my_allocator
@@ -276,10 +1225,10 @@ inline void * my_malloc(const size_t size) {
 //    return NULL;
 //  }
 
-  // Set the appropriate new header values calculated above
+  // Set the appropriate new header values calculated above. The block is
+  // long-lived until malloc_chunked says otherwise
   header = (header_t *)p;
-  set_size(stored_size, header);
-  set_in_use(header);
+  header->size = stored_size;
   
   // Set the appropriate new footer values calculated above
   footer = (footer_t *)((uint8_t *) p + offsetof(header_t, next) + stored_size);
@@ -298,29 +1247,103 @@ inline void * my_malloc(const size_t size) {
 
 // free the block of memory at address void* ptr. This method checks the size of the block we want to free 
 // and calculates its hash so that it can go into the proper ranged bin
-void my_free(void *ptr) {
+__attribute__((flatten)) void my_free(void *ptr) {
+  MAINT_GUARD();
   header_t * header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
+#ifdef NURSERY
+  if (is_nursery(header)) {
+    nursery_free(header);
+    return;
+  }
+#endif
+#ifdef DENSE_SMALL
+  if (is_dense(header)) {
+    dense_free(&default_heap, header);
+    return;
+  }
+#endif
+  if (is_mapped(header)) {
+    unmap_block(header);
+    return;
+  }
   assert(is_free(header) == false);
   assert(get_size(header) > 0);
   assert(get_size(header) == ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + get_size(header)))->size);
 
-  header = coalesce(ptr);
-  size_t size = get_size(header);
-  assert(size == ALIGN(size));
-  size_t stored_memory = ALIGN(size);
-  size_t sig_bit = calculate_hash(stored_memory); // Get the most significant bit of the amount of memory we stored
-  
-  assert(sig_bit < LIST_SIZE);
-  header->prev = NULL;
-  header->next = free_lists[sig_bit]; // Store free space in proper ranged_bin
-  if (free_lists[sig_bit] != NULL) {
-    free_lists[sig_bit]->prev = header;
+#ifdef DECAY_PURGE
+  if (++default_heap.purge_ticks >= PURGE_TICKS) {
+    default_heap.purge_ticks = 0;
+    purge_blocks(&default_heap, PURGE_DECAY_MS);
   }
-  set_free(header);
-  free_lists[sig_bit] = header;
+#endif
+#ifdef BACKGROUND_MAINTENANCE
+  if (maint_running) {
+    // Leave the merging to the maintenance thread
+    header->next = default_heap.deferred;
+    __atomic_store_n(&default_heap.deferred, header, __ATOMIC_RELAXED);
+    return;
+  }
+#endif
+  release_block(&default_heap, header);
+}
+
+// release_block - Merge an in-use block with its free neighbours and put
+// the result on a bin
+static void release_block(my_heap_t * h, header_t * header) {
+  const void * ptr = (uint8_t *)header + offsetof(header_t, next);
+
+  if (!is_short(header)) {
+    // The common case. Spelling the class out lets coalesce and
+    // insert_free_block drop their short-lived branches
+    insert_free_block(h, coalesce(h, ptr, false), false);
+    return;
+  }
+  bool short_lived = true;
+  header = coalesce(h, ptr, true);
+  if (get_size(header) + TAGS_SIZE >= SHORT_CHUNK) {
+    // A whole chunk's worth is free again: give it back to the main heap
+    short_lived = false;
+    header = coalesce(h, (uint8_t *)header + offsetof(header_t, next), false);
+  }
+  insert_free_block(h, header, short_lived);
+}
+
+// insert_free_block - Push a block onto the bin for its size, without
+// merging it with its neighbours
+static inline void insert_free_block(my_heap_t * h, header_t * header, const bool short_lived) {
+  size_t size = get_size(header);
+  assert(size == ALIGN_PAYLOAD(size));
+  size_t sig_bit = calculate_hash(size); // Get the most significant bit of the amount of memory we stored
+  
+  assert(sig_bit < LIST_SIZE);
+  header_t ** lists = short_lived ? h->short_lists : h->free_lists;
+  header->prev = NULL;
+  header->next = lists[sig_bit]; // Store free space in proper ranged_bin
+  if (lists[sig_bit] != NULL) {
+    lists[sig_bit]->prev = header;
+  }
+  set_free(header);
+  if (short_lived) {
+    header->size |= SHORT_BIT;
+  } else {
+    header->size &= ~SHORT_BIT;
+  }
+#ifdef DECAY_PURGE
+  if (size >= PURGE_MIN_SIZE && !short_lived) {
+    purge_tag(header)->freed_ms = purge_clock();
+    purge_tag(header)->purged = 0;
+  }
+#endif
+#ifdef SIDE_METADATA
+  if (meta_covers(h, header)) {
+    meta_mark_free(h, header);
+  }
+#endif
+  lists[sig_bit] = header;
   assert(get_size(header) == ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + size))->size);
-  if (sig_bit > free_list_max) {
-    free_list_max = sig_bit;
+  int * list_max = short_lived ? &h->short_list_max : &h->free_list_max;
+  if ((int)sig_bit > *list_max) {
+    *list_max = sig_bit;
   }
 }
 
@@ -330,58 +1353,1080 @@ void my_free(void *ptr) {
 // - reallocing last block, just expand the end of the heap the amount you need to,
 // instead of trying to find a completely new spot to store the block
 void * my_realloc(void *ptr, size_t size) {
+  MAINT_GUARD();
   if (ptr == NULL) {
     return my_malloc(size);
   } else if (size == 0) {
     my_free(ptr);
     return NULL;
+  } else if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  
+  void *newptr;
+  size_t copy_size;
+
+#ifdef NURSERY
+  header_t * nursery_header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
+  if (is_nursery(nursery_header)) {
+    copy_size = nursery_size(nursery_header);
+    if (size <= copy_size) {
+      return ptr;
+    }
+    newptr = my_malloc(size);
+    if (newptr != NULL) {
+      block_copy(newptr, ptr, copy_size);
+      nursery_free(nursery_header);
+    }
+    return newptr;
+  }
+#endif
+#ifdef DENSE_SMALL
+  header_t * dense_header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
+  if (is_dense(dense_header)) {
+    copy_size = dense_size(dense_header);
+    if (size <= copy_size) {
+      return ptr;
+    }
+    newptr = my_malloc(size);
+    if (newptr != NULL) {
+      block_copy(newptr, ptr, copy_size);
+      dense_free(&default_heap, dense_header);
+    }
+    return newptr;
+  }
+#endif
+
+  // Allocate a new chunk of memory, and fail if that allocation fails.
+  header_t * header = (header_t *)((uint8_t*)ptr - offsetof(header_t, next));
+ 
+  size_t new_size = ALIGN_PAYLOAD(size);
+
+  // Get the size of the old block of memory.  Take a peek at my_malloc(),
+  // where we stashed this in the SIZE_T_SIZE bytes directly before the
+  // address we returned.  Now we can back up by that many bytes and read
+  // the size.
+  copy_size = get_size(header);
+ 
+  // If the new block is smaller than the old one, we have to stop copying
+  // early so that we don't write off the end of the new block of memory.
+  // The same goes for a request that still fits in the slack at the end of
+  // the block (see my_malloc_usable_size).
+  if (size <= copy_size) {
+    //TODO FREE REMAINING MEMORY
+    return ptr;     
+  }
+
+  // A mapped block that stays large keeps its pages, which the kernel can
+  // move for us without copying a byte
+  if (is_mapped(header) && size >= MMAP_THRESHOLD) {
+    newptr = remap_block(header, size);
+    if (newptr != NULL) {
+      return newptr;
+    }
+  }
+
+  if (grow_at_top(&default_heap, header, new_size)) {
+    return ptr;
+  }
+  // Could not grow in place, fall back to moving the block
+
+  newptr = my_malloc(size);
+  if (NULL == newptr)
+    return NULL;
+
+  // This is a standard library call that performs a simple memory copy.
+  block_copy(newptr, ptr, copy_size);
+
+  // Release the old block.
+  my_free(ptr);
+
+  // Return a pointer to the new block.
+  return newptr;
+}
+
+// calloc - Allocate a zeroed array of nmemb elements of size bytes each.
+// Blocks that my_malloc carved from never-used heap are already zero, so
+// only recycled memory gets cleared.
+void * my_calloc(size_t nmemb, size_t size) {
+  MAINT_GUARD();
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    return NULL;
+  }
+
+  default_heap.fresh_block = false;
+  void * p = my_malloc(total);
+  if (p != NULL && !default_heap.fresh_block) {
+    block_zero(p, total);
+  }
+  return p;
+}
+
+// grow_at_top - The last block of the heap can grow without moving, by
+// moving the break (or an instance's closing sentinel) up behind it
+static bool grow_at_top(my_heap_t * h, header_t * header, const size_t stored_size) {
+  const size_t old_size = get_size(header);
+  uint8_t * right_most = (uint8_t *)header + offsetof(header_t, next) + old_size + FOOTER_T_SIZE;
+  if (is_mapped(header) || right_most != h->brk ||
+      my_allocator(h, stored_size - old_size) == NULL) {
+    return false;
+  }
+  set_size(stored_size, header);
+  ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + stored_size))->size = stored_size;
+  return true;
+}
+
+// malloc_usable_size - The number of bytes the caller may use at ptr. This
+// can be more than was asked for: the request is rounded up, and a block
+// taken from a free_list is kept whole when the leftover is too small to
+// split off.
+size_t my_malloc_usable_size(void * ptr) {
+  if (ptr == NULL) {
+    return 0;
+  }
+  header_t * header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
+#ifdef NURSERY
+  if (is_nursery(header)) {
+    return nursery_size(header);
+  }
+#endif
+#ifdef DENSE_SMALL
+  if (is_dense(header)) {
+    return dense_size(header);
+  }
+#endif
+  return get_size(header);
+}
+
+// malloc_good_size - The smallest usable size that a request for size bytes
+// can come back with. Asking for this much instead of size costs nothing.
+size_t my_malloc_good_size(size_t size) {
+  if (size > MAX_REQUEST) {
+    return size;
+  }
+#ifdef NURSERY
+  if (size <= NURSERY_MAX) {
+    return ALIGN(size + (size == 0) + offsetof(header_t, next)) - offsetof(header_t, next);
+  }
+#endif
+#ifdef DENSE_SMALL
+  if (size <= DENSE_MAX) {
+    return DENSE_STRIDE(size) - offsetof(header_t, next);
+  }
+#endif
+  if (size < FREE_HEADER_SIZE) {
+    return ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+  }
+  return ALIGN_PAYLOAD(size);
+}
+
+// malloc_at_least - my_malloc that also reports how many bytes the caller
+// actually got, so that containers can grow into the slack.
+void * my_malloc_at_least(size_t size, size_t * actual) {
+  void * p = my_malloc(size);
+  if (p != NULL && actual != NULL) {
+    *actual = my_malloc_usable_size(p);
+  }
+  return p;
+}
+
+// memalign - Allocate a block whose payload is a multiple of alignment.
+// We over-allocate with my_malloc so that an aligned address with room for
+// a whole free block in front of it is guaranteed to exist, then give the
+// leading and trailing slack back to the free_lists.
+void * my_memalign(size_t alignment, size_t size) {
+  MAINT_GUARD();
+  if ((alignment & (alignment - 1)) != 0) {
+    // Only powers of two make sense as an alignment
+    return NULL;
+  }
+  if (alignment <= ALIGNMENT) {
+    return malloc_block(&default_heap, size);
+  }
+  if (size > MAX_REQUEST - alignment - MIN_BLOCK_SIZE) {
+    return NULL;
+  }
+  if (size >= MMAP_THRESHOLD) {
+    return map_block(size, alignment);
+  }
+
+  uint8_t * p = (uint8_t *)malloc_block(&default_heap, size + alignment + MIN_BLOCK_SIZE);
+  if (p == NULL) {
+    return NULL;
+  }
+  header_t * header = (header_t *)(p - offsetof(header_t, next));
+
+  if (((uintptr_t)p & (alignment - 1)) != 0) {
+    // Move the payload up to the first aligned address that leaves enough
+    // room in front of it for a free block
+    uint8_t * aligned = (uint8_t *)(((uintptr_t)p + MIN_BLOCK_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    const size_t lead = aligned - p;
+    const size_t block_size = get_size(header);
+    assert(lead >= MIN_BLOCK_SIZE);
+    assert(block_size >= lead + size);
+
+    // The leading slack keeps the original header
+    const size_t lead_size = lead - offsetof(header_t, next) - FOOTER_T_SIZE;
+    set_size(lead_size, header);
+    ((footer_t *)(p + lead_size))->size = lead_size;
+
+    // The aligned block starts right after it and ends where the old one did
+    header_t * aligned_header = (header_t *)(aligned - offsetof(header_t, next));
+    aligned_header->size = block_size - lead;
+    set_in_use(aligned_header);
+    ((footer_t *)(aligned + get_size(aligned_header)))->size = get_size(aligned_header);
+
+    my_free(p);
+    p = aligned;
+    header = aligned_header;
+  }
+
+  // Give back whatever is left over past the end of the payload
+  size_t stored_size = ALIGN_PAYLOAD(size);
+  if (size < FREE_HEADER_SIZE) {
+    stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+  }
+  if (get_size(header) - stored_size >= MIN_BLOCK_SIZE) {
+    split_block(&default_heap, header, stored_size);
+  }
+  return p;
+}
+
+#ifdef CACHE_LINE_PLACEMENT
+// malloc_on_line - Allocate a block with up to a line of slack, then move
+// the payload up to the next line boundary. The lead is less than a line,
+// often too small to be a block, and carving it off as one would litter
+// the small bins with fragments that every search has to step over.
+// Instead it moves the boundary with the left neighbour: a free neighbour
+// takes it back onto its free_list, an in use one simply gets the bytes.
+static void * malloc_on_line(my_heap_t * h, const size_t size) {
+  uint8_t * p = (uint8_t *)malloc_block(h, size + CACHE_LINE_SIZE - ALIGNMENT);
+  if (p == NULL) {
+    return NULL;
+  }
+  header_t * header = (header_t *)(p - offsetof(header_t, next));
+  const size_t lead = -(uintptr_t)p & (CACHE_LINE_SIZE - 1);
+
+  // The first block in the heap or in a segment has no neighbour to give
+  // the lead to; in a segment the neighbour is the size 0 sentinel
+  if (lead != 0 && (uint8_t *)header != h->lo &&
+      ((footer_t *)((uint8_t *)header - FOOTER_T_SIZE))->size != 0) {
+    // Read this before the left footer moves up over the old header
+    const size_t block_size = get_size(header) - lead;
+    footer_t * left_foot = (footer_t *)((uint8_t *)header - FOOTER_T_SIZE);
+    header_t * left_header = (header_t *)((uint8_t *)left_foot - left_foot->size - offsetof(header_t, next));
+    const bool left_free = is_free(left_header);
+    if (left_free) {
+      remove_free_list_address(h, left_header);
+      set_in_use(left_header);
+    }
+    const size_t left_size = get_size(left_header) + lead;
+    set_size(left_size, left_header);
+    ((footer_t *)((uint8_t *)left_header + offsetof(header_t, next) + left_size))->size = left_size;
+
+    header = (header_t *)((uint8_t *)header + lead);
+    header->size = block_size;
+    ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + block_size))->size = block_size;
+    p += lead;
+
+    if (left_free) {
+      my_free((uint8_t *)left_header + offsetof(header_t, next));
+    }
+  }
+
+  // Give back the tail on the same terms as malloc_block
+  size_t stored_size = ALIGN_PAYLOAD(size);
+  if (get_size(header) - stored_size >= FREE_HEADER_SIZE + SPLIT_CONSTANT + TAGS_SIZE) {
+    split_block(h, header, stored_size);
+  }
+  return p;
+}
+#endif
+
+// aligned_alloc - C11 interface to my_memalign
+void * my_aligned_alloc(size_t alignment, size_t size) {
+  return my_memalign(alignment, size);
+}
+
+// posix_memalign - POSIX interface to my_memalign. The alignment must be a
+// power of two multiple of sizeof(void *).
+int my_posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void * p = my_memalign(alignment, size);
+  if (p == NULL) {
+    return ENOMEM;
+  }
+  *memptr = p;
+  return 0;
+}
+
+// malloc_batch - Allocate n blocks of size bytes each into ptrs. Rather
+// than searching the bins n times, we find (or sbrk) one region big enough
+// for all of them and cut it up in a single pass. Returns how many blocks
+// were allocated, which is less than n only when the heap is exhausted.
+size_t my_malloc_batch(size_t size, size_t n, void ** ptrs) {
+  MAINT_GUARD();
+  my_heap_t * h = &default_heap;
+  if (n == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  size_t stored_size = ALIGN_PAYLOAD(size);
+  if (size < FREE_HEADER_SIZE) {
+    stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+  }
+  const size_t block_size = stored_size + TAGS_SIZE;
+
+  // The region is handled as one in use block until it is cut up
+  size_t region_size;
+  header_t * region = NULL;
+#ifdef CACHE_LINE_PLACEMENT
+  // Blocks packed back to back would not start on lines of their own
+  const bool packed = (size < CACHE_LINE_SIZE);
+#else
+  const bool packed = true;
+#endif
+  if (packed && size < MMAP_THRESHOLD && !__builtin_mul_overflow(block_size, n, &region_size) &&
+      region_size <= MAX_REQUEST) {
+    const size_t region_stored = region_size - TAGS_SIZE;
+    region = find_free_block(h->free_lists, h->free_list_max, region_stored);
+    if (region != NULL) {
+      remove_free_list_address(h, region);
+      set_in_use(region);
+      if (get_size(region) - region_stored >= MIN_BLOCK_SIZE) {
+        split_block(h, region, region_stored);
+      }
+    } else if ((region = (header_t *)heap_grow(h, region_size)) != NULL) {
+      region->size = region_stored;
+    }
+  }
+
+  if (region == NULL) {
+    // No single region to be had, so get the blocks one at a time
+    size_t i;
+    for (i = 0; i < n; i++) {
+      if ((ptrs[i] = my_malloc(size)) == NULL) {
+        break;
+      }
+    }
+    return i;
+  }
+
+  // The last block keeps whatever was too small to split off the region
+  uint8_t * p = (uint8_t *)region;
+  const size_t last_size = get_size(region) - (n - 1) * block_size;
+  for (size_t i = 0; i < n; i++) {
+    header_t * header = (header_t *)p;
+    const size_t this_size = (i == n - 1) ? last_size : stored_size;
+    header->size = this_size;
+    ((footer_t *)(p + offsetof(header_t, next) + this_size))->size = this_size;
+    ptrs[i] = p + offsetof(header_t, next);
+    p += this_size + TAGS_SIZE;
+  }
+  return n;
+}
+
+// my_free_batch sorts this many of the caller's pointers at a time, in an
+// array of its own on the stack (tunable value)
+#define FREE_BATCH_SORT 256
+
+// free_batch - Free the n blocks in ptrs. The pointers are sorted by
+// address, FREE_BATCH_SORT at a time in a copy (ptrs itself is left as it
+// is), so that runs of neighbouring blocks (such as those handed out by
+// my_malloc_batch) are merged first and coalesced with the rest of the
+// heap once per run instead of once per block. NULL entries are skipped.
+void my_free_batch(void ** ptrs, size_t n) {
+  MAINT_GUARD();
+  void * sorted[FREE_BATCH_SORT];
+  for (size_t k = 0; k < n; k += FREE_BATCH_SORT) {
+    const size_t m = (n - k < FREE_BATCH_SORT) ? n - k : FREE_BATCH_SORT;
+    memcpy(sorted, ptrs + k, m * sizeof(void *));
+    sort_pointers(sorted, m);
+    free_sorted(sorted, m);
+  }
+}
+
+static void free_sorted(void ** ptrs, const size_t n) {
+  size_t i = 0;
+  while (i < n && ptrs[i] == NULL) {
+    i++;
+  }
+  while (i < n) {
+    header_t * first = (header_t *)((uint8_t *)ptrs[i] - offsetof(header_t, next));
+#ifdef NURSERY
+    if (is_nursery(first)) {
+      nursery_free(first);
+      i++;
+      continue;
+    }
+#endif
+#ifdef DENSE_SMALL
+    if (is_dense(first)) {
+      dense_free(&default_heap, first);
+      i++;
+      continue;
+    }
+#endif
+    if (is_mapped(first)) {
+      unmap_block(first);
+      i++;
+      continue;
+    }
+    uint8_t * end = (uint8_t *)ptrs[i] + get_size(first) + FOOTER_T_SIZE;
+
+    // Extend the run while the next pointer's header starts where this
+    // block ends, and the block is of the same lifetime class
+    size_t j = i + 1;
+    while (j < n && (uint8_t *)ptrs[j] - offsetof(header_t, next) == end) {
+      header_t * header = (header_t *)end;
+      if (is_mapped(header) || is_short(header) != is_short(first)) {
+        break;
+      }
+      assert(is_free(header) == false);
+      end = (uint8_t *)ptrs[j] + get_size(header) + FOOTER_T_SIZE;
+      j++;
+    }
+    if (j > i + 1) {
+      const size_t run_size = end - (uint8_t *)ptrs[i] - FOOTER_T_SIZE;
+      set_size(run_size, first);
+      ((footer_t *)(end - FOOTER_T_SIZE))->size = run_size;
+    }
+
+    my_free(ptrs[i]);
+    i = j;
+  }
+}
+
+// reserve - Pre-warm the heap for a known mix of requests: for each i,
+// counts[i] free blocks that fit sizes[i] bytes exactly. The heap grows
+// once for all of them, and each block goes straight onto its bin without
+// being merged with its neighbours, so the first requests after startup
+// neither grow the heap nor split blocks. Sizes that would be mapped are
+// skipped. Returns 0 on success, or -1 if the heap could not grow.
+int my_reserve(const size_t * sizes, const size_t * counts, size_t n) {
+  MAINT_GUARD();
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (sizes[i] >= MMAP_THRESHOLD) {
+      continue;
+    }
+    size_t stored_size = ALIGN_PAYLOAD(sizes[i]);
+    if (sizes[i] < FREE_HEADER_SIZE) {
+      stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+    }
+    size_t bytes;
+    if (__builtin_mul_overflow(stored_size + TAGS_SIZE, counts[i], &bytes) ||
+        __builtin_add_overflow(total, bytes, &total)) {
+      return -1;
+    }
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint8_t * p = (uint8_t *)heap_grow(&default_heap, total);
+  if (p == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (sizes[i] >= MMAP_THRESHOLD) {
+      continue;
+    }
+    size_t stored_size = ALIGN_PAYLOAD(sizes[i]);
+    if (sizes[i] < FREE_HEADER_SIZE) {
+      stored_size = ALIGN_PAYLOAD(FREE_HEADER_SIZE);
+    }
+    for (size_t c = 0; c < counts[i]; c++) {
+      header_t * header = (header_t *)p;
+      header->size = stored_size;
+      ((footer_t *)(p + offsetof(header_t, next) + stored_size))->size = stored_size;
+      insert_free_block(&default_heap, header, false);
+      p += stored_size + TAGS_SIZE;
+    }
+  }
+  return 0;
+}
+
+// halloc - Allocate size bytes that my_compact is allowed to move. Returns
+// 0 if either the block or a slot for its handle could not be had.
+my_handle_t my_halloc(size_t size) {
+  MAINT_GUARD();
+  my_heap_t * h = &default_heap;
+  if (size > MAX_REQUEST - HANDLE_TAG_SIZE) {
+    return 0;
+  }
+  my_handle_t handle = handle_new(h);
+  if (handle == 0) {
+    return 0;
+  }
+  uint8_t * p = (uint8_t *)my_malloc(size + HANDLE_TAG_SIZE);
+  if (p == NULL) {
+    h->handle_slots[handle].next = h->handle_free;
+    h->handle_free = handle;
+    return 0;
+  }
+  *(size_t *)p = handle;
+  h->handle_slots[handle].ptr = p + HANDLE_TAG_SIZE;
+  h->handle_slots[handle].locks = 0;
+  return handle;
+}
+
+// hfree - Free a handle's block and recycle the handle. Freeing 0 does
+// nothing, like free(NULL).
+void my_hfree(my_handle_t handle) {
+  MAINT_GUARD();
+  if (handle == 0) {
+    return;
+  }
+  my_heap_t * h = &default_heap;
+  assert(handle < h->handle_count);
+  handle_slot_t * slot = &h->handle_slots[handle];
+  my_free(slot->ptr - HANDLE_TAG_SIZE);
+  slot->next = h->handle_free;
+  slot->locks = 0;
+  h->handle_free = handle;
+}
+
+// hlock - Pin a handle's block and return its address. Locks nest; the
+// address stays good until the last my_hunlock.
+void * my_hlock(my_handle_t handle) {
+  handle_slot_t * slot = &default_heap.handle_slots[handle];
+  assert(handle != 0 && handle < default_heap.handle_count);
+  slot->locks++;
+  return slot->ptr;
+}
+
+void my_hunlock(my_handle_t handle) {
+  handle_slot_t * slot = &default_heap.handle_slots[handle];
+  assert(handle != 0 && handle < default_heap.handle_count);
+  assert(slot->locks > 0);
+  slot->locks--;
+}
+
+// compact - Slide every unlocked handle block down toward the bottom of the
+// heap, over the free blocks below it. Other blocks and locked handle blocks
+// stay put, and the space left just below each of them becomes one free
+// block. Whatever is free at the top of the heap afterwards is handed back
+// to memlib; at the top of a segment it just becomes one more free block.
+// Returns the number of bytes the heap shrank by.
+size_t my_compact(void) {
+  MAINT_GUARD();
+  my_heap_t * h = &default_heap;
+#ifdef NURSERY
+  // Blocks in a nursery chunk cannot be moved where they are
+  nursery_evacuate();
+#endif
+#ifdef DENSE_SMALL
+  // Nor can those in a slab
+  dense_evacuate(h);
+#endif
+#ifdef BACKGROUND_MAINTENANCE
+  // Deferred blocks would otherwise be pinned in place as if in use
+  maint_drain(h, false);
+#endif
+
+  // Every free block ends up in a gap, so the bins are rebuilt from scratch
+  for (int i = 0; i < LIST_SIZE; i++) {
+    h->free_lists[i] = NULL;
+    h->short_lists[i] = NULL;
+  }
+  h->free_list_max = h->short_list_max = 0;
+  h->rover = NULL;
+
+  bool gap_short;
+  for (segment_t * segment = h->segments; segment != NULL; segment = segment->next) {
+    uint8_t * gap = compact_range(h, (uint8_t *)segment + SEGMENT_FIRST, segment->end, &gap_short);
+    if (gap != NULL) {
+      free_gap(h, gap, segment->end, gap_short);
+    }
+  }
+
+  // Free space at the top goes back to memlib, whatever its class
+  uint8_t * gap = compact_range(h, h->lo, h->brk, &gap_short);
+  if (gap == NULL) {
+    return 0;
+  }
+  const size_t trimmed = h->brk - gap;
+  mem_sbrk(-(intptr_t)trimmed);
+  h->brk = gap;
+  return trimmed;
+}
+
+// heap_create - Make a heap instance in backing bytes of fresh pages of its
+// own. Returns NULL if they cannot be had. Large requests are placed in
+// the instance like any other, rather than mapped apart.
+my_heap_t * my_heap_create(size_t backing) {
+  MAINT_GUARD();
+  const size_t page = mem_pagesize();
+  if (backing > SIZE_MAX - page) {
+    return NULL;
+  }
+  backing = (backing + page - 1) / page * page;
+  uint8_t * mem = (uint8_t *)mem_map(backing);
+  if (mem == NULL) {
+    return NULL;
+  }
+  my_heap_t * h = heap_format(mem, backing);
+  if (h == NULL) {
+    mem_unmap(mem, backing);
+    return NULL;
+  }
+  h->map_len = backing;
+  return h;
+}
+
+// heap_create_in_buffer - Make a heap instance that lives in the len bytes
+// at buf, which stay the caller's to free once the heap is done with.
+// Returns NULL if they are too few to hold even the heap's own state.
+my_heap_t * my_heap_create_in_buffer(void * buf, size_t len) {
+  MAINT_GUARD();
+  return heap_format((uint8_t *)buf, len);
+}
+
+// heap_destroy - Drop a heap instance and every block in it
+void my_heap_destroy(my_heap_t * h) {
+  MAINT_GUARD();
+  if (h->map_len != 0) {
+    mem_unmap(h, h->map_len);
+  }
+}
+
+// heap_malloc - my_malloc from a heap instance. Hints, chunking for the
+// short-lived and cache line placement are left to the default heap
+void * my_heap_malloc(my_heap_t * h, size_t size) {
+  MAINT_GUARD();
+  return malloc_block(h, size);
+}
+
+// heap_free - my_free for a block from my_heap_malloc(h, ...)
+void my_heap_free(my_heap_t * h, void * ptr) {
+  MAINT_GUARD();
+  if (ptr == NULL) {
+    return;
+  }
+  assert(my_heap_owns(h, ptr));
+  release_block(h, (header_t *)((uint8_t *)ptr - offsetof(header_t, next)));
+}
+
+// heap_realloc - my_realloc for a block of a heap instance. The block stays
+// in h, growing in place when it is the last one, and moving otherwise
+void * my_heap_realloc(my_heap_t * h, void * ptr, size_t size) {
+  MAINT_GUARD();
+  if (ptr == NULL) {
+    return malloc_block(h, size);
+  } else if (size == 0) {
+    my_heap_free(h, ptr);
+    return NULL;
+  } else if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  assert(my_heap_owns(h, ptr));
+  header_t * header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
+  const size_t copy_size = get_size(header);
+  if (size <= copy_size) {
+    return ptr;
+  }
+  if (grow_at_top(h, header, ALIGN_PAYLOAD(size))) {
+    return ptr;
+  }
+  void * newptr = malloc_block(h, size);
+  if (newptr == NULL) {
+    return NULL;
+  }
+  block_copy(newptr, ptr, copy_size);
+  release_block(h, header);
+  return newptr;
+}
+
+// heap_calloc - my_calloc from a heap instance. Memory an instance made by
+// my_heap_create grows into is fresh, so only recycled blocks are cleared
+void * my_heap_calloc(my_heap_t * h, size_t nmemb, size_t size) {
+  MAINT_GUARD();
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    return NULL;
+  }
+
+  h->fresh_block = false;
+  void * p = malloc_block(h, total);
+  if (p != NULL && !h->fresh_block) {
+    block_zero(p, total);
+  }
+  return p;
+}
+
+// heap_check - my_check for a heap instance: its blocks run from the first
+// to the closing sentinel, and its bins hold only free blocks of their class
+int my_heap_check(const my_heap_t * h) {
+  MAINT_GUARD();
+  uint8_t * first = heap_first(h);
+  if (((header_t *)(first - TAGS_SIZE))->size != 0 ||
+      ((footer_t *)(first - FOOTER_T_SIZE))->size != 0 ||
+      ((header_t *)h->brk)->size != 0) {
+    printf("Heap %p has lost its sentinels!\n", (const void *)h);
+    return -1;
+  }
+  uint8_t * p = first;
+  while (p < h->brk) {
+    p += get_size((header_t *)p) + TAGS_SIZE;
+  }
+  if (p != h->brk) {
+    printf("Bad headers did not end at the sentinel of heap %p!\n", (const void *)h);
+    printf("first: %p, brk: %p, p: %p\n", first, h->brk, p);
+    return -1;
+  }
+  return check_bins(h) ? 0 : -1;
+}
+
+// heap_owns - Whether ptr points into a heap instance's blocks, for callers
+// that keep several heaps and have to send each free to the right one
+int my_heap_owns(const my_heap_t * h, const void * ptr) {
+  return (const uint8_t *)ptr > (const uint8_t *)h && (const uint8_t *)ptr < h->brk;
+}
+
+// Regions take their memory from the default heap in chunks. The first is
+// REGION_FIRST_CHUNK bytes and each one after it twice the one before, up
+// to REGION_CHUNK bytes, so that a region that stays small stays in a
+// small chunk. A request too big for that gets a chunk just big enough
+// (tunable values)
+#ifndef REGION_FIRST_CHUNK
+#define REGION_FIRST_CHUNK (4 * 1024)
+#endif
+#ifndef REGION_CHUNK
+#define REGION_CHUNK (64 * 1024)
+#endif
+
+// A region chunk is a my_malloc block that starts with this. Chunks stay
+// chained in the order they were first used, those of large requests
+// included, so that a region that has been reset walks the same chunks
+// again before asking for more, and a reset has nothing to free.
+typedef struct region_chunk_t {
+  struct region_chunk_t * next;
+  uint8_t * end;  // end of the chunk's usable bytes
+} region_chunk_t;
+
+#define REGION_CHUNK_DATA(c) ((uint8_t *)(c) + ALIGN(sizeof(region_chunk_t)))
+
+// A region lives in its first chunk, right after the chunk header. Bytes
+// from cur to end of the current chunk are what is left to bump through.
+struct my_region_t {
+  region_chunk_t * first;
+  region_chunk_t * chunk;  // the chunk being bumped through
+  uint8_t * cur;
+  uint8_t * end;
+};
+
+// region_chunk_new - A chunk of size bytes, header included, or NULL if
+// the heap has none to give
+static region_chunk_t * region_chunk_new(size_t size) {
+  region_chunk_t * c = (region_chunk_t *)my_malloc(size);
+  if (c == NULL) {
+    return NULL;
+  }
+  c->next = NULL;
+  c->end = (uint8_t *)c + my_malloc_usable_size(c);
+  return c;
+}
+
+// region_create - An empty region, or NULL if the heap is out of memory
+my_region_t * my_region_create(void) {
+  region_chunk_t * c = region_chunk_new(REGION_FIRST_CHUNK);
+  if (c == NULL) {
+    return NULL;
+  }
+  my_region_t * r = (my_region_t *)REGION_CHUNK_DATA(c);
+  r->first = c;
+  r->chunk = c;
+  r->cur = REGION_CHUNK_DATA(c) + ALIGN(sizeof(my_region_t));
+  r->end = c->end;
+  return r;
+}
+
+// region_grow - Take size bytes that do not fit in r's current chunk: r
+// moves on to the next chunk in the chain that has room for them, adding
+// one at the end if there is none.
+static void * region_grow(my_region_t * r, size_t size) {
+  region_chunk_t * c = r->chunk;
+  while (c->next != NULL && size > (size_t)(c->next->end - REGION_CHUNK_DATA(c->next))) {
+    c = c->next;
+  }
+  if (c->next == NULL) {
+    if (size > MAX_REQUEST - ALIGN(sizeof(region_chunk_t))) {
+      return NULL;
+    }
+    size_t bytes = 2 * (size_t)(c->end - (uint8_t *)c);
+    if (bytes > REGION_CHUNK) {
+      bytes = REGION_CHUNK;
+    }
+    if (bytes < size + ALIGN(sizeof(region_chunk_t))) {
+      bytes = size + ALIGN(sizeof(region_chunk_t));
+    }
+    if ((c->next = region_chunk_new(bytes)) == NULL) {
+      return NULL;
+    }
+  }
+  c = c->next;
+  r->chunk = c;
+  r->cur = REGION_CHUNK_DATA(c) + size;
+  r->end = c->end;
+  return REGION_CHUNK_DATA(c);
+}
+
+// region_alloc - size bytes from r, ALIGNMENT-byte aligned. The common
+// case is a bounds check and a pointer bump. Returns NULL if the heap is
+// out of memory.
+void * my_region_alloc(my_region_t * r, size_t size) {
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+  size = (size == 0) ? ALIGNMENT : ALIGN(size);
+  if (size <= (size_t)(r->end - r->cur)) {
+    void * p = r->cur;
+    r->cur += size;
+    return p;
+  }
+  return region_grow(r, size);
+}
+
+// region_chunks_free - Give a chain of chunks back to the heap
+static void region_chunks_free(region_chunk_t * c) {
+  while (c != NULL) {
+    region_chunk_t * next = c->next;
+    my_free(c);
+    c = next;
+  }
+}
+
+// region_reset - Free every block of r at once, in constant time. The
+// chunks are kept, and are bumped through again in the same order before
+// any new one is taken, except for one that r did not get to since the
+// last reset, if any: a region that once grew large gives its chunks
+// back one reset at a time once it no longer needs them.
+void my_region_reset(my_region_t * r) {
+  region_chunk_t * unused = r->chunk->next;
+  if (unused != NULL) {
+    r->chunk->next = unused->next;
+    my_free(unused);
+  }
+  r->chunk = r->first;
+  r->cur = (uint8_t *)r + ALIGN(sizeof(my_region_t));
+  r->end = r->first->end;
+}
+
+// region_destroy - Free every block of r and give its chunks back to the
+// heap. r itself goes with the first of them.
+void my_region_destroy(my_region_t * r) {
+  region_chunks_free(r->first);
+}
+
+// A pool's first chunk holds this many objects, and each chunk after it
+// twice as many as the one before, up to POOL_CHUNK bytes of objects per
+// chunk (or one object, if that is bigger) (tunable values)
+#define POOL_FIRST_OBJECTS 16
+#ifndef POOL_CHUNK
+#define POOL_CHUNK (16 * 1024)
+#endif
+
+// The objects of a pool's chunks would otherwise start at the same offset
+// from the chunk, so that walking the chunks side by side hits the same
+// cache sets. As map_block does for mapped blocks, each new chunk of a pool
+// moves its first object one cache line further in, cycling through this
+// many colors. Define it as 1 to turn coloring off (tunable value)
+#ifndef POOL_COLORS
+#define POOL_COLORS 8
+#endif
+
+// A pool chunk is a block from the default heap that starts with this,
+// followed by the objects at the pool's alignment
+typedef struct pool_chunk_t {
+  struct pool_chunk_t * next;
+} pool_chunk_t;
+
+// A pool of same-sized objects. Objects that have been put back are kept
+// on a list threaded through their first word; the rest are carved off the
+// newest chunk, from cur to end, only once they are first needed.
+struct my_pool_t {
+  void * free;
+  uint8_t * cur;
+  uint8_t * end;
+  pool_chunk_t * chunks;
+  size_t size;           // object size, rounded up to align
+  size_t align;
+  size_t chunk_objects;  // objects in the next chunk
+  unsigned color;        // cache lines to skip at the start of the next chunk
+};
+
+// Rounds size up to a multiple of align, a power of two
+#define POOL_ROUND(size, align) (((size) + (align) - 1) & ~((align) - 1))
+
+// pool_create - A pool handing out obj_size byte objects aligned to align,
+// a power of two (0 for ALIGNMENT). Returns NULL if align is not a power
+// of two, or if obj_size or align is too big.
+my_pool_t * my_pool_create(size_t obj_size, size_t align) {
+  if (align == 0) {
+    align = ALIGNMENT;
+  }
+  if ((align & (align - 1)) != 0 || align > MAX_REQUEST || obj_size > MAX_REQUEST) {
+    return NULL;
+  }
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+  if (obj_size < sizeof(void *)) {
+    obj_size = sizeof(void *);
+  }
+  // A pool and its chunks stay until my_pool_destroy, so keep them out of
+  // the nursery
+  my_pool_t * p = (my_pool_t *)my_malloc_hint(sizeof(my_pool_t), MY_HINT_LONG_LIVED);
+  if (p == NULL) {
+    return NULL;
+  }
+  p->free = NULL;
+  p->cur = NULL;
+  p->end = NULL;
+  p->chunks = NULL;
+  p->size = POOL_ROUND(obj_size, align);
+  p->align = align;
+  p->chunk_objects = POOL_FIRST_OBJECTS;
+  p->color = 0;
+  return p;
+}
+
+// pool_grow - Add a chunk to p and take the first object from it
+static void * pool_grow(my_pool_t * p) {
+  size_t n = p->chunk_objects;
+  if (n > POOL_CHUNK / p->size) {
+    n = (POOL_CHUNK / p->size > 0) ? POOL_CHUNK / p->size : 1;
+  } else {
+    p->chunk_objects *= 2;
+  }
+  // Objects aligned past a cache line are spread out enough as it is
+  size_t head = POOL_ROUND(sizeof(pool_chunk_t), p->align);
+  if (p->align <= CACHE_LINE_SIZE) {
+    head += p->color * CACHE_LINE_SIZE;
+    p->color = (p->color + 1) % POOL_COLORS;
+  }
+  if (n > (MAX_REQUEST - head) / p->size) {
+    return NULL;
+  }
+  const size_t bytes = head + n * p->size;
+  pool_chunk_t * c = (pool_chunk_t *)((p->align <= ALIGNMENT) ?
+                                      my_malloc_hint(bytes, MY_HINT_LONG_LIVED) :
+                                      my_memalign(p->align, bytes));
+  if (c == NULL) {
+    return NULL;
   }
-  
-  void *newptr;
-  size_t copy_size;
-
-  // Allocate a new chunk of memory, and fail if that allocation fails.
-  header_t * header = (header_t *)((uint8_t*)ptr - offsetof(header_t, next));
- 
-  size_t new_size = ALIGN(size);
+  c->next = p->chunks;
+  p->chunks = c;
+  p->cur = (uint8_t *)c + head + p->size;
+  p->end = (uint8_t *)c + my_malloc_usable_size(c);
+  return (uint8_t *)c + head;
+}
 
-  // Get the size of the old block of memory.  Take a peek at my_malloc(),
-  // where we stashed this in the SIZE_T_SIZE bytes directly before the
-  // address we returned.  Now we can back up by that many bytes and read
-  // the size.
-  copy_size = get_size(header);
- 
-  // If the new block is smaller than the old one, we have to stop copying
-  // early so that we don't write off the end of the new block of memory.
-  if (size < copy_size) {
-    //TODO FREE REMAINING MEMORY
-    return ptr;     
+// pool_get - An object from p: the last one put back, else the next one
+// in the newest chunk. Returns NULL if the heap is out of memory.
+void * my_pool_get(my_pool_t * p) {
+  void * obj = p->free;
+  if (obj != NULL) {
+    p->free = *(void **)obj;
+    return obj;
+  }
+  if (p->size <= (size_t)(p->end - p->cur)) {
+    obj = p->cur;
+    p->cur += p->size;
+    return obj;
   }
+  return pool_grow(p);
+}
 
-  size_t difference = new_size - copy_size;
-  void * right_most = (void *)((uint8_t *)header + offsetof(header_t, next) + copy_size + FOOTER_T_SIZE);
-  if (right_most == (void *)(mem_heap_hi() + 1)) { //This is the last block in the heap
-    mem_sbrk(difference);
-    set_size(new_size, header);
-    return ptr;
+// pool_put - Give an object from my_pool_get(p) back to p. Its memory
+// stays with the pool until my_pool_destroy.
+void my_pool_put(my_pool_t * p, void * obj) {
+  if (obj == NULL) {
+    return;
   }
+  *(void **)obj = p->free;
+  p->free = obj;
+}
 
-  newptr = my_malloc(size);
-  if (NULL == newptr)
-    return NULL;
+// pool_destroy - Free p and every object in it, put back or not
+void my_pool_destroy(my_pool_t * p) {
+  pool_chunk_t * c = p->chunks;
+  while (c != NULL) {
+    pool_chunk_t * next = c->next;
+    my_free(c);
+    c = next;
+  }
+  my_free(p);
+}
 
-  // This is a standard library call that performs a simple memory copy.
-  memcpy(newptr, ptr, copy_size);
+// purge - Hand the pages of large free blocks that have been idle for at
+// least decay_ms back to the kernel (all of them, for 0). my_free already
+// does this every so often with PURGE_DECAY_MS; this is for callers that
+// know they are about to go quiet. Returns the number of bytes purged, which
+// is always 0 unless the allocator was built with -DDECAY_PURGE.
+size_t my_purge(unsigned decay_ms) {
+  MAINT_GUARD();
+#ifdef DECAY_PURGE
+  return purge_blocks(&default_heap, decay_ms);
+#else
+  (void)decay_ms;
+  return 0;
+#endif
+}
 
-  // Release the old block.
-  my_free(ptr);
+// maint_start - Start the maintenance thread, waking every interval_us
+// microseconds. Returns 0 on success, or -1 with errno set if the thread
+// could not be started or this build has no maintenance thread.
+int my_maint_start(unsigned interval_us) {
+#ifdef BACKGROUND_MAINTENANCE
+  if (interval_us == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  my_maint_stop();
+  maint_interval = interval_us;
+  maint_stop_flag = false;
+  int err = pthread_create(&maint_thread, NULL, maint_main, NULL);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  maint_running = true;
+  return 0;
+#else
+  (void)interval_us;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
-  // Return a pointer to the new block.
-  return newptr;
+// maint_stop - Stop the maintenance thread and finish, on this thread,
+// whatever merging it had not got to
+void my_maint_stop(void) {
+#ifdef BACKGROUND_MAINTENANCE
+  if (!maint_running) {
+    return;
+  }
+  // Wake the thread rather than wait out its sleep
+  pthread_mutex_lock(&maint_lock);
+  maint_stop_flag = true;
+  pthread_cond_signal(&maint_wake);
+  pthread_mutex_unlock(&maint_lock);
+  pthread_join(maint_thread, NULL);
+  maint_running = false;
+  maint_drain(&default_heap, false);
+#endif
 }
 
 // call mem_reset_brk.
 inline void my_reset_brk() {
+  MAINT_GUARD();
+#ifdef BACKGROUND_MAINTENANCE
+  __atomic_store_n(&default_heap.deferred, NULL, __ATOMIC_RELAXED);
+#endif
   mem_reset_brk();
 }
 
@@ -397,11 +2442,11 @@ inline void * my_heap_hi() {
 
 // Use the gcc built in function (defined as left_zeros) to help us calculate the log2
 static inline int calculate_hash(const size_t size) {
-  const int sig_bit = 31 - left_zeros(size);
+  const int sig_bit = (SIZE_T_BITS - 1) - left_zeros(size);
   return sig_bit; 
 }
 
-inline void * free_remaining_memory(const void * p, const size_t free_list_size, const size_t aligned_size) {
+inline void * free_remaining_memory(my_heap_t * h, const void * p, const size_t free_list_size, const size_t aligned_size) {
   header_t * free_block = (header_t *)((uint8_t *)p + aligned_size);
   size_t free_block_size = free_list_size - aligned_size;
   footer_t * free_block_footer = (footer_t *)((uint8_t *)free_block + offsetof(header_t, next) + free_block_size);
@@ -409,31 +2454,66 @@ inline void * free_remaining_memory(const void * p, const size_t free_list_size,
   assert(free_block_size >= FREE_HEADER_SIZE);
   assert((uint8_t *) free_block > (uint8_t *)p);
 
-  set_size(free_block_size, free_block);
+  // free_block is new, so nothing in its header is worth keeping
+  free_block->size = free_block_size | (((const header_t *)p)->size & SHORT_BIT);
   free_block_footer->size = free_block_size;
-  set_in_use(free_block);
-  assert(get_size(free_block) == ((footer_t *)((uint8_t *)free_block + offsetof(header_t, next) + free_block->size))->size);
+  assert(get_size(free_block) == ((footer_t *)((uint8_t *)free_block + offsetof(header_t, next) + get_size(free_block)))->size);
 
+  if (h != &default_heap) {
+    // my_free would defer it or tick the purge clock, both of which are
+    // for the default heap's blocks only
+    release_block(h, free_block);
+    return NULL;
+  }
   my_free((void*)((uint8_t *)free_block + offsetof(header_t, next)));
   return NULL;
 }
 
-inline header_t * coalesce(const void * ptr) {
+static inline void split_block(my_heap_t * h, header_t * header, const size_t stored_size) {
+  const size_t block_size = get_size(header);
+  assert(block_size - stored_size >= MIN_BLOCK_SIZE);
+
+  // The block keeps its lifetime class, and the remainder inherits it
+  set_size(stored_size, header);
+  footer_t * footer = (footer_t *)((uint8_t *)header + offsetof(header_t, next) + stored_size);
+  footer->size = stored_size;
+  free_remaining_memory(h, header, block_size, stored_size + TAGS_SIZE);
+}
+
+inline header_t * coalesce(my_heap_t * h, const void * ptr, const bool short_lived) {
   header_t * header = (header_t *)((uint8_t *)ptr - offsetof(header_t, next));
   footer_t * footer = (footer_t *)((uint8_t *)ptr + get_size(header));
   assert(get_size(header) == ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + get_size(header)))->size);  
   bool is_left_free = false;
   footer_t * left_foot;
-  size_t left_size;
-  header_t * left_header;
+  size_t left_size = 0;
+  header_t * left_header = NULL;
+#ifdef SIDE_METADATA
+  const bool covered = meta_covers(h, header);
+#endif
 
-  if ((char *)header > (char *)my_heap_lo()) {
+  // At either end of a segment the neighbour is an in use sentinel
+  if ((uint8_t *)header != h->lo) {
     left_foot = (footer_t *)((uint8_t *)header - FOOTER_T_SIZE);
-    left_size = left_foot->size;
-    left_header = (header_t *)((uint8_t *)left_foot - left_size - offsetof(header_t, next));
-    is_left_free = is_free(left_header);
-    assert(left_size == get_size(left_header));
-    assert(left_size >= FREE_HEADER_SIZE);
+#ifdef SIDE_METADATA
+    if (covered) {
+      // Only a free left neighbour is looked at, and then only to unlink it
+      const size_t g = granule(h, header);
+      if (meta_test(h->meta_ends, g - 1)) {
+        left_header = (header_t *)granule_addr(h, meta_prev_set(h->meta_starts, g - 1));
+        left_size = (uint8_t *)left_foot - (uint8_t *)left_header - offsetof(header_t, next);
+        assert(is_free(left_header));
+        is_left_free = (is_short(left_header) == short_lived);
+      }
+    } else
+#endif
+    {
+      left_size = left_foot->size;
+      left_header = (header_t *)((uint8_t *)left_foot - left_size - offsetof(header_t, next));
+      is_left_free = is_free(left_header) && (is_short(left_header) == short_lived);
+    }
+    assert(!is_left_free || left_size == get_size(left_header));
+    assert(!is_left_free || left_size >= FREE_HEADER_SIZE);
   }
 
   bool is_right_free = false;
@@ -441,9 +2521,14 @@ inline header_t * coalesce(const void * ptr) {
   size_t right_size;
   footer_t * right_footer;
  
-  if ((char *)footer + FOOTER_T_SIZE < (char *)my_heap_hi() + 1) {
+  if ((uint8_t *)footer + FOOTER_T_SIZE != h->brk) {
     right_header = (header_t *)((uint8_t *)header + offsetof(header_t, next) + get_size(header) + FOOTER_T_SIZE);
+#ifdef SIDE_METADATA
+    is_right_free = covered ? meta_test(h->meta_starts, granule(h, right_header)) : is_free(right_header);
+#else
     is_right_free = is_free(right_header);
+#endif
+    is_right_free = is_right_free && (is_short(right_header) == short_lived);
     
     assert(get_size(header) == ((footer_t *)((uint8_t *)header + offsetof(header_t, next) + get_size(header)))->size);
 //    assert(right_size == right_footer->size);
@@ -456,7 +2541,7 @@ inline header_t * coalesce(const void * ptr) {
   
   if (is_left_free) {
     // Remove left from it's current free_list
-    remove_free_list_address(left_header);
+    remove_free_list_address(h, left_header);
 
     // Change the size appropriately 
     new_size += left_size + FOOTER_T_SIZE + offsetof(header_t, next);
@@ -466,11 +2551,17 @@ inline header_t * coalesce(const void * ptr) {
   } 
 
   if (is_right_free) {
+#ifdef SIDE_METADATA
+    right_size = covered ? granule_addr(h, meta_next_set(h, h->meta_ends, granule(h, right_header)) + 1) - (uint8_t *)right_header - TAGS_SIZE
+                         : get_size(right_header);
+    assert(right_size == get_size(right_header));
+#else
     right_size = get_size(right_header);
+#endif
     right_footer = (footer_t *)((uint8_t *)right_header + offsetof(header_t, next) + right_size);
 
     // Remove right from it's current free_list
-    remove_free_list_address(right_header);
+    remove_free_list_address(h, right_header);
     
     // Change the size appropriately
     new_size += FOOTER_T_SIZE + offsetof(header_t, next) + right_size;
@@ -478,22 +2569,33 @@ inline header_t * coalesce(const void * ptr) {
     new_footer = right_footer;
   }
 
-  // Update the free_list values
-  set_in_use(new_header);
-  set_size(new_size, new_header);
+  // Update the free_list values. The merged block is of the class asked for,
+  // whatever header started it
+  new_header->size = new_size | (short_lived ? SHORT_BIT : 0);
   new_footer->size = new_size;
-  assert(get_size(new_header) == ((footer_t *)((uint8_t *)new_header + offsetof(header_t, next) + new_header->size))->size);
+  assert(get_size(new_header) == ((footer_t *)((uint8_t *)new_header + offsetof(header_t, next) + get_size(new_header)))->size);
   return new_header;  
 }
 
-inline void remove_free_list_address(header_t * hdr_ptr) {
+inline void remove_free_list_address(my_heap_t * h, header_t * hdr_ptr) {
   size_t size;
   size_t hash;
 
+  if (hdr_ptr == h->rover) {
+    h->rover = hdr_ptr->next;
+  }
+
+#ifdef SIDE_METADATA
+  if (meta_covers(h, hdr_ptr)) {
+    meta_mark_used(h, hdr_ptr);
+  }
+#endif
+
   if (hdr_ptr->prev == NULL) {
     size = get_size(hdr_ptr);
     hash = calculate_hash(size);
-    free_lists[hash] = hdr_ptr->next;
+    header_t ** lists = is_short(hdr_ptr) ? h->short_lists : h->free_lists;
+    lists[hash] = hdr_ptr->next;
   } else {
     (hdr_ptr->prev)->next = hdr_ptr->next;
   }
@@ -503,6 +2605,96 @@ inline void remove_free_list_address(header_t * hdr_ptr) {
   }
 }
 
+static inline header_t * place_block(my_heap_t * h, const size_t size, const int sig_bit) {
+  header_t * block;
+  switch (h->placement) {
+    case PLACE_FIRST:
+      return find_free_block(h->free_lists, h->free_list_max, size);
+
+    case PLACE_NEXT: {
+      // Start at the rover if it is in the request's bin, and wrap around
+      header_t * start = h->free_lists[sig_bit];
+      if (h->rover != NULL && calculate_hash(get_size(h->rover)) == sig_bit) {
+        start = h->rover;
+      }
+      for (block = start; block != NULL; block = block->next) {
+        if (get_size(block) >= size) {
+          h->rover = block->next;
+          return block;
+        }
+      }
+      for (block = h->free_lists[sig_bit]; block != start; block = block->next) {
+        if (get_size(block) >= size) {
+          h->rover = block->next;
+          return block;
+        }
+      }
+      for (int i = sig_bit + 1; i <= h->free_list_max; i++) {
+        if (h->free_lists[i] != NULL) {
+          block = (h->rover != NULL && calculate_hash(get_size(h->rover)) == i) ? h->rover : h->free_lists[i];
+          h->rover = block->next;
+          return block;
+        }
+      }
+      return NULL;
+    }
+
+    case PLACE_ADDRESS: {
+      // The bins are not kept in address order, so this walks a whole bin
+      header_t * best = NULL;
+      for (block = h->free_lists[sig_bit]; block != NULL; block = block->next) {
+        if (get_size(block) >= size && (best == NULL || block < best)) {
+          best = block;
+        }
+      }
+      for (int i = sig_bit + 1; best == NULL && i <= h->free_list_max; i++) {
+        for (block = h->free_lists[i]; block != NULL; block = block->next) {
+          if (best == NULL || block < best) {
+            best = block;
+          }
+        }
+      }
+      return best;
+    }
+
+    default:
+      // Linear search the request's bin for a fit, then take the first of
+      // the larger bins with anything in it
+      for (block = h->free_lists[sig_bit]; block != NULL; block = block->next) {
+        if (get_size(block) >= size) {
+          return get_best_block(size, block);
+        }
+      }
+      for (int i = sig_bit + 1; i <= h->free_list_max; i++) {
+        if (h->free_lists[i] != NULL) {
+          return get_best_block(size, h->free_lists[i]);
+        }
+      }
+      return NULL;
+  }
+}
+
+// placement_set - Choose how malloc picks among the free blocks that fit
+// a request: "best" (the default), "first", "next" or "address" (see
+// placement_t). Returns 0, or -1 if name is none of these. The free_lists
+// are shared by all of them, so this can be changed at any time.
+int my_placement_set(const char * name) {
+  for (int i = 0; i < PLACE_COUNT; i++) {
+    if (strcmp(name, placement_names[i]) == 0) {
+      default_heap.placement = (placement_t)i;
+      placement_chosen = true;
+      default_heap.rover = NULL;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// placement - The name of the policy in use
+const char * my_placement(void) {
+  return placement_names[default_heap.placement];
+}
+
 inline header_t * get_best_block(const size_t size, header_t * best_block) {
   header_t * test_block = best_block->next;
   size_t best_size = get_size(best_block);
@@ -518,3 +2710,526 @@ inline header_t * get_best_block(const size_t size, header_t * best_block) {
   }
   return best_block;
 }
+
+static header_t * find_free_block(header_t ** lists, const int list_max, const size_t size) {
+  const int sig_bit = calculate_hash(size);
+  for (header_t * block = lists[sig_bit]; block != NULL; block = block->next) {
+    if (get_size(block) >= size) {
+      return block;
+    }
+  }
+  // Anything in a bigger bin is big enough
+  for (int i = sig_bit + 1; i <= list_max; i++) {
+    if (lists[i] != NULL) {
+      return lists[i];
+    }
+  }
+  return NULL;
+}
+
+// Shell sort: no extra memory, and close to linear on input that is
+// already mostly in order, which is the common case for batches.
+static void sort_pointers(void ** ptrs, const size_t n) {
+  size_t gap = 1;
+  while (gap < n / 3) {
+    gap = 3 * gap + 1;
+  }
+  for (; gap > 0; gap /= 3) {
+    for (size_t i = gap; i < n; i++) {
+      void * p = ptrs[i];
+      size_t j = i;
+      while (j >= gap && (uintptr_t)ptrs[j - gap] > (uintptr_t)p) {
+        ptrs[j] = ptrs[j - gap];
+        j -= gap;
+      }
+      ptrs[j] = p;
+    }
+  }
+}
+
+static void * map_block(const size_t size, const size_t alignment) {
+  const size_t page = mem_pagesize();
+
+  // The payload goes right after the mapped_t unless it needs to be
+  // aligned further. Alignments up to a page come for free, since the
+  // mapping itself is page aligned; beyond that we map extra and skip ahead.
+  size_t offset = sizeof(mapped_t);
+  size_t extra = 0;
+  if (alignment > page) {
+    extra = alignment;
+  } else if (alignment > offset) {
+    offset = alignment;
+  }
+
+  // Then color it, in steps that keep the alignment
+  static unsigned color = 0;
+  if (extra == 0) {
+    const size_t step = (alignment > CACHE_LINE_SIZE) ? alignment : CACHE_LINE_SIZE;
+    const size_t shift = color * step;
+    color = (color + 1) % MAP_COLORS;
+    if (offset + shift < page) {
+      offset += shift;
+    }
+  }
+  if (size > MAX_REQUEST - offset - extra - page) {
+    return NULL;
+  }
+  const size_t length = (offset + extra + size + page - 1) & ~(page - 1);
+
+  uint8_t * base = (uint8_t *)mem_map(length);
+  if (base == NULL) {
+    return NULL;
+  }
+  if (extra > 0) {
+    offset = (((uintptr_t)base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - (uintptr_t)base;
+  }
+
+  uint8_t * p = base + offset;
+  mapped_t * mapped = (mapped_t *)(p - sizeof(mapped_t));
+  mapped->offset = offset;
+  mapped->size = (length - offset) | MAPPED_BIT;
+
+  return p;
+}
+
+static void unmap_block(header_t * header) {
+  mapped_t * mapped = (mapped_t *)((uint8_t *)header - offsetof(mapped_t, size));
+  const size_t offset = mapped->offset;
+  mem_unmap((uint8_t *)mapped + sizeof(mapped_t) - offset, offset + get_size(header));
+}
+
+static void * remap_block(header_t * header, const size_t size) {
+  const size_t page = mem_pagesize();
+  mapped_t * mapped = (mapped_t *)((uint8_t *)header - offsetof(mapped_t, size));
+  const size_t offset = mapped->offset;
+  uint8_t * base = (uint8_t *)mapped + sizeof(mapped_t) - offset;
+
+  if (size > MAX_REQUEST - offset - page) {
+    return NULL;
+  }
+  const size_t old_length = offset + get_size(header);
+  const size_t length = (offset + size + page - 1) & ~(page - 1);
+
+  base = (uint8_t *)mem_remap(base, old_length, length);
+  if (base == NULL) {
+    return NULL;
+  }
+  // The pages moved with their contents, mapped_t included
+  mapped = (mapped_t *)(base + offset - sizeof(mapped_t));
+  mapped->size = (length - offset) | MAPPED_BIT;
+  return base + offset;
+}
+
+#ifdef DECAY_PURGE
+static inline uint64_t purge_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static size_t purge_blocks(my_heap_t * h, const unsigned decay_ms) {
+  const uint64_t now = purge_clock();
+  size_t purged = 0;
+  for (int i = calculate_hash(PURGE_MIN_SIZE); i <= h->free_list_max; i++) {
+    for (header_t * block = h->free_lists[i]; block != NULL; block = block->next) {
+      purge_tag_t * tag = purge_tag(block);
+      if (get_size(block) < PURGE_MIN_SIZE || tag->purged || now - tag->freed_ms < decay_ms) {
+        continue;
+      }
+      uint8_t * footer = (uint8_t *)block + offsetof(header_t, next) + get_size(block);
+      purged += mem_purge(tag + 1, footer - (uint8_t *)(tag + 1));
+      tag->purged = 1;
+    }
+  }
+  return purged;
+}
+#endif
+
+#ifdef BACKGROUND_MAINTENANCE
+static inline int maint_enter(void) {
+  if (maint_depth++ == 0 && maint_running) {
+    __atomic_store_n(&fg_busy, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&bg_active, __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+static inline void maint_leave(int * guard) {
+  (void)guard;
+  if (--maint_depth == 0) {
+    __atomic_store_n(&fg_busy, 0, __ATOMIC_RELEASE);
+  }
+}
+
+static bool maint_drain(my_heap_t * h, const bool yield) {
+  while (h->deferred != NULL) {
+    if (yield && __atomic_load_n(&fg_busy, __ATOMIC_RELAXED)) {
+      return false;
+    }
+    header_t * header = h->deferred;
+    __atomic_store_n(&h->deferred, header->next, __ATOMIC_RELAXED);
+    release_block(h, header);
+  }
+  return true;
+}
+
+static void maint_trim(my_heap_t * h) {
+  if (h->brk <= h->lo) {
+    return;
+  }
+  const size_t size = ((footer_t *)(h->brk - FOOTER_T_SIZE))->size;
+  header_t * header = (header_t *)(h->brk - size - TAGS_SIZE);
+  if (is_free(header) && !is_short(header) && size + TAGS_SIZE >= MAINT_TRIM_THRESHOLD) {
+    remove_free_list_address(h, header);
+    mem_sbrk(-(intptr_t)(size + TAGS_SIZE));
+    h->brk = (uint8_t *)header;
+  }
+}
+
+// Merge sort of one bin through the next links; prev is fixed up after
+static header_t * sort_bin(header_t * list, const size_t n) {
+  if (n <= 1) {
+    if (list != NULL) {
+      list->next = NULL;
+    }
+    return list;
+  }
+  header_t * right = list;
+  for (size_t i = 0; i < n / 2; i++) {
+    right = right->next;
+  }
+  header_t * left = sort_bin(list, n / 2);
+  right = sort_bin(right, n - n / 2);
+
+  header_t * head = NULL;
+  header_t ** tail = &head;
+  while (left != NULL && right != NULL) {
+    header_t ** smaller = (get_size(right) < get_size(left)) ? &right : &left;
+    *tail = *smaller;
+    tail = &(*smaller)->next;
+    *smaller = (*smaller)->next;
+  }
+  *tail = (left != NULL) ? left : right;
+  return head;
+}
+
+static void maint_sort_bins(my_heap_t * h, const bool yield) {
+  for (int i = 0; i <= h->free_list_max; i++) {
+    if (yield && __atomic_load_n(&fg_busy, __ATOMIC_RELAXED)) {
+      return;
+    }
+    size_t n = 0;
+    bool sorted = true;
+    for (header_t * block = h->free_lists[i]; block != NULL; block = block->next) {
+      if (block->next != NULL && get_size(block->next) < get_size(block)) {
+        sorted = false;
+      }
+      n++;
+    }
+    if (sorted) {
+      continue;
+    }
+    h->free_lists[i] = sort_bin(h->free_lists[i], n);
+    header_t * prev = NULL;
+    for (header_t * block = h->free_lists[i]; block != NULL; block = block->next) {
+      block->prev = prev;
+      prev = block;
+    }
+  }
+}
+
+static void * maint_main(void * arg) {
+  (void)arg;
+  pthread_mutex_lock(&maint_lock);
+  while (!maint_stop_flag) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(maint_interval % 1000000) * 1000;
+    deadline.tv_sec += maint_interval / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&maint_wake, &maint_lock, &deadline);
+    if (maint_stop_flag || __atomic_load_n(&default_heap.deferred, __ATOMIC_RELAXED) == NULL) {
+      continue;
+    }
+    pthread_mutex_unlock(&maint_lock);
+
+    __atomic_store_n(&bg_active, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&fg_busy, __ATOMIC_SEQ_CST) && maint_drain(&default_heap, true)) {
+      maint_trim(&default_heap);
+      maint_sort_bins(&default_heap, true);
+#ifdef DECAY_PURGE
+      purge_blocks(&default_heap, PURGE_DECAY_MS);
+#endif
+    }
+    __atomic_store_n(&bg_active, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&maint_lock);
+  }
+  pthread_mutex_unlock(&maint_lock);
+  return NULL;
+}
+#endif
+
+static my_handle_t handle_new(my_heap_t * h) {
+  if (h->handle_free != 0) {
+    const my_handle_t handle = h->handle_free;
+    h->handle_free = h->handle_slots[handle].next;
+    return handle;
+  }
+  if (h->handle_count == 0) {
+    h->handle_count = 1;
+  }
+  if ((h->handle_count + 1) * sizeof(handle_slot_t) > h->handle_bytes) {
+    // Double the table; fresh pages come zeroed
+    const size_t bytes = (h->handle_bytes == 0) ? mem_pagesize() : 2 * h->handle_bytes;
+    handle_slot_t * slots = (h->handle_bytes == 0)
+        ? (handle_slot_t *)mem_map(bytes)
+        : (handle_slot_t *)mem_remap(h->handle_slots, h->handle_bytes, bytes);
+    if (slots == NULL) {
+      return 0;
+    }
+    h->handle_slots = slots;
+    h->handle_bytes = bytes;
+  }
+  return h->handle_count++;
+}
+
+static inline handle_slot_t * handle_of(const my_heap_t * h, const header_t * header) {
+  // A free slot holds a small index, never a heap address, so only the
+  // block a live handle points at can pass this test
+  const uint8_t * data = (const uint8_t *)header + offsetof(header_t, next);
+  const size_t handle = *(const size_t *)data;
+  if (handle == 0 || handle >= h->handle_count ||
+      h->handle_slots[handle].ptr != data + HANDLE_TAG_SIZE) {
+    return NULL;
+  }
+  return &h->handle_slots[handle];
+}
+
+static uint8_t * compact_range(my_heap_t * h, uint8_t * p, const uint8_t * hi, bool * gap_short) {
+  uint8_t * gap = NULL;  // start of the free space below p, if any
+  while (p < hi) {
+    header_t * header = (header_t *)p;
+    const size_t block_size = get_size(header) + TAGS_SIZE;
+    if (is_free(header)) {
+#ifdef SIDE_METADATA
+      if (meta_covers(h, header)) {
+        meta_mark_used(h, header);
+      }
+#endif
+      // A gap holds free space of one lifetime class only
+      if (gap != NULL && is_short(header) != *gap_short) {
+        free_gap(h, gap, p, *gap_short);
+        gap = NULL;
+      }
+      if (gap == NULL) {
+        gap = p;
+        *gap_short = is_short(header);
+      }
+    } else if (gap != NULL) {
+      // Handle blocks are long-lived, so they only slide down into
+      // long-lived gaps
+      handle_slot_t * slot = handle_of(h, header);
+      if (slot != NULL && slot->locks == 0 && !*gap_short) {
+        memmove(gap, p, block_size);
+        slot->ptr = gap + offsetof(header_t, next) + HANDLE_TAG_SIZE;
+        gap += block_size;
+      } else {
+        free_gap(h, gap, p, *gap_short);
+        gap = NULL;
+      }
+    }
+    p += block_size;
+  }
+  return gap;
+}
+
+static inline void free_gap(my_heap_t * h, uint8_t * start, const uint8_t * end, const bool short_lived) {
+  header_t * header = (header_t *)start;
+  const size_t size = (end - start) - TAGS_SIZE;
+  header->size = size;
+  ((footer_t *)(start + offsetof(header_t, next) + size))->size = size;
+  insert_free_block(h, header, short_lived);
+}
+
+static inline uint8_t * heap_first(const my_heap_t * h) {
+  return (uint8_t *)(ALIGN((uintptr_t)(h + 1) + TAGS_SIZE + offsetof(header_t, next)) -
+                     offsetof(header_t, next));
+}
+
+static bool check_bins(const my_heap_t * h) {
+  for (int i = 0; i < LIST_SIZE; i++) {
+    for (header_t * b = h->free_lists[i]; b != NULL; b = b->next) {
+      if (!is_free(b) || is_short(b)) {
+        printf("Block %p on free_lists[%d] is not a long-lived free block!\n", (void *)b, i);
+        return false;
+      }
+    }
+    for (header_t * b = h->short_lists[i]; b != NULL; b = b->next) {
+      if (!is_free(b) || !is_short(b)) {
+        printf("Block %p on short_lists[%d] is not a short-lived free block!\n", (void *)b, i);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static my_heap_t * heap_format(uint8_t * mem, const size_t len) {
+  // The state, then the opening sentinel, then the closing one where the
+  // first block will go, with its payload aligned
+  my_heap_t * h = (my_heap_t *)ALIGN((uintptr_t)mem);
+  uint8_t * first = heap_first(h);
+  if (len < (size_t)(first - mem) + sizeof(header_t *)) {
+    return NULL;
+  }
+  memset(h, 0, sizeof(my_heap_t));
+  h->placement = default_heap.placement;
+  h->lo = first;
+  h->brk = first;
+  h->end = mem + len;
+  ((header_t *)(first - TAGS_SIZE))->size = 0;
+  ((footer_t *)(first - FOOTER_T_SIZE))->size = 0;
+  ((header_t *)first)->size = 0;
+  return h;
+}
+
+static void * segment_new(my_heap_t * h, const size_t size) {
+  const size_t page = mem_pagesize();
+  const size_t overhead = SEGMENT_FIRST + sizeof(header_t *);
+  if (size > SIZE_MAX - overhead - 2 * page) {
+    return NULL;
+  }
+  size_t len = (size + overhead + page - 1) / page * page;
+  if (len < SEGMENT_SIZE) {
+    len = SEGMENT_SIZE;
+  }
+  // Whatever is left over has to be big enough to be a free block
+  size_t rest = len - overhead - size;
+  if (rest != 0 && rest < MIN_BLOCK_SIZE) {
+    len += page;
+    rest += page;
+  }
+
+  segment_t * segment = (segment_t *)mem_map(len);
+  if (segment == NULL) {
+    return NULL;
+  }
+  uint8_t * first = (uint8_t *)segment + SEGMENT_FIRST;
+  segment->len = len;
+  segment->end = (uint8_t *)segment + len - sizeof(header_t *);
+  segment->next = h->segments;
+  h->segments = segment;
+
+  // The mapping is zeroed, but spell the sentinels out anyway
+  ((header_t *)(first - TAGS_SIZE))->size = 0;
+  ((footer_t *)(first - FOOTER_T_SIZE))->size = 0;
+  ((header_t *)segment->end)->size = 0;
+  if (rest != 0) {
+    free_gap(h, first + size, segment->end, false);
+  }
+  return first;
+}
+
+static void * heap_grow(my_heap_t * h, const size_t size) {
+  void * p = my_allocator(h, size);
+  // A heap instance has to stay inside its own memory
+  if (p == NULL && h == &default_heap) {
+    p = segment_new(h, size);
+    if (p == NULL) {
+      mem_out_of_memory();
+    }
+  }
+  return p;
+}
+
+#ifdef SIDE_METADATA
+static bool meta_cover(my_heap_t * h, const void * hi) {
+  // One bitmap page covers this many bytes of heap
+  const size_t page = mem_pagesize();
+  const size_t span = page * 8 * ALIGNMENT;
+  const size_t bytes = (uint8_t *)hi - h->meta_base;
+  const size_t needed = (bytes + span - 1) / span * page;
+  if (needed <= h->meta_bytes) {
+    return true;
+  }
+
+  // New pages come from the kernel zeroed, which is what we want
+  uint64_t * starts;
+  uint64_t * ends;
+  if (h->meta_bytes == 0) {
+    starts = (uint64_t *)mem_map(needed);
+    ends = (starts == NULL) ? NULL : (uint64_t *)mem_map(needed);
+    if (ends == NULL && starts != NULL) {
+      mem_unmap(starts, needed);
+    }
+  } else {
+    starts = (uint64_t *)mem_remap(h->meta_starts, h->meta_bytes, needed);
+    if (starts == NULL) {
+      return false;
+    }
+    h->meta_starts = starts;
+    ends = (uint64_t *)mem_remap(h->meta_ends, h->meta_bytes, needed);
+    if (ends == NULL) {
+      // Both maps must stay the same length
+      h->meta_starts = (uint64_t *)mem_remap(h->meta_starts, needed, h->meta_bytes);
+      return false;
+    }
+  }
+  if (ends == NULL) {
+    return false;
+  }
+  h->meta_starts = starts;
+  h->meta_ends = ends;
+  h->meta_bytes = needed;
+  return true;
+}
+
+static void meta_trim(my_heap_t * h, const size_t bytes) {
+  if (bytes == h->meta_bytes) {
+    return;
+  }
+  if (bytes == 0) {
+    mem_unmap(h->meta_starts, h->meta_bytes);
+    mem_unmap(h->meta_ends, h->meta_bytes);
+    h->meta_starts = h->meta_ends = NULL;
+  } else {
+    // Shrinking a mapping in place cannot fail
+    h->meta_starts = (uint64_t *)mem_remap(h->meta_starts, h->meta_bytes, bytes);
+    h->meta_ends = (uint64_t *)mem_remap(h->meta_ends, h->meta_bytes, bytes);
+  }
+  h->meta_bytes = bytes;
+}
+
+static inline void meta_mark_free(my_heap_t * h, const header_t * header) {
+  meta_set(h->meta_starts, granule(h, header));
+  meta_set(h->meta_ends, granule(h, (uint8_t *)header + get_size(header) + TAGS_SIZE) - 1);
+}
+
+static inline void meta_mark_used(my_heap_t * h, const header_t * header) {
+  meta_clear(h->meta_starts, granule(h, header));
+  meta_clear(h->meta_ends, granule(h, (uint8_t *)header + get_size(header) + TAGS_SIZE) - 1);
+}
+
+static size_t meta_prev_set(const uint64_t * map, size_t g) {
+  size_t i = g / 64;
+  uint64_t word = map[i] & (~(uint64_t)0 >> (63 - g % 64));
+  while (word == 0) {
+    assert(i > 0);
+    word = map[--i];
+  }
+  return i * 64 + 63 - __builtin_clzl(word);
+}
+
+static size_t meta_next_set(const my_heap_t * h, const uint64_t * map, size_t g) {
+  size_t i = g / 64;
+  uint64_t word = map[i] & (~(uint64_t)0 << (g % 64));
+  while (word == 0) {
+    assert(i + 1 < h->meta_bytes / sizeof(uint64_t));
+    word = map[++i];
+  }
+  return i * 64 + __builtin_ctzl(word);
+}
+#endif
@@ -26,6 +26,17 @@
 #ifndef _ALLOCATOR_INTERFACE_H
 #define _ALLOCATOR_INTERFACE_H
 
+/* Lifetime hints for malloc_hint. Allocators are free to ignore them. */
+#define MY_HINT_NONE         0x0
+#define MY_HINT_SHORT_LIVED  0x1  /* freed soon, e.g. request-scoped */
+#define MY_HINT_LONG_LIVED   0x2  /* kept around, e.g. cache entries */
+
+/* A region hands out blocks that are only ever freed all at once */
+typedef struct my_region_t my_region_t;
+
+/* A handle names a block that the allocator may move; 0 is never one */
+typedef size_t my_handle_t;
+
 /* Function pointers for a malloc implementation.  This is used to allow a
  * single validator to operate on both libc malloc, a buggy malloc, and the
  * student "mm" malloc.
@@ -35,16 +46,41 @@ typedef struct {
   void *(*malloc)(size_t size);
   void *(*realloc)(void *ptr, size_t size);
   void (*free)(void *ptr);
+  void *(*memalign)(size_t alignment, size_t size);
+  void *(*calloc)(size_t nmemb, size_t size);
+  void *(*malloc_hint)(size_t size, unsigned hint);
+  size_t (*usable_size)(void *ptr);
+  size_t (*malloc_batch)(size_t size, size_t n, void **ptrs);
+  void (*free_batch)(void **ptrs, size_t n);
+  int (*reserve)(const size_t *sizes, const size_t *counts, size_t n);
   int (*check)();
   void (*reset_brk)(void);
   void *(*heap_lo)(void);
   void *(*heap_hi)(void);
+  /* Optional: left NULL, the driver frees region blocks one by one */
+  my_region_t *(*region_create)(void);
+  void *(*region_alloc)(my_region_t *region, size_t size);
+  void (*region_reset)(my_region_t *region);
+  void (*region_destroy)(my_region_t *region);
+  /* Optional: left NULL, the driver mallocs handle blocks and never moves them */
+  my_handle_t (*halloc)(size_t size);
+  void (*hfree)(my_handle_t handle);
+  void *(*hlock)(my_handle_t handle);
+  void (*hunlock)(my_handle_t handle);
+  size_t (*compact)(void);
 } malloc_impl_t;
 
 int libc_init();
 void * libc_malloc(size_t size);
 void * libc_realloc(void *ptr, size_t size);
 void libc_free(void *ptr);
+void * libc_memalign(size_t alignment, size_t size);
+void * libc_calloc(size_t nmemb, size_t size);
+void * libc_malloc_hint(size_t size, unsigned hint);
+size_t libc_malloc_usable_size(void *ptr);
+size_t libc_malloc_batch(size_t size, size_t n, void **ptrs);
+void libc_free_batch(void **ptrs, size_t n);
+int libc_reserve(const size_t *sizes, const size_t *counts, size_t n);
 int libc_check();
 void libc_reset_brk();
 void * libc_heap_lo();
@@ -52,27 +88,121 @@ void * libc_heap_hi();
 
 static const malloc_impl_t libc_impl =
 { .init = &libc_init, .malloc = &libc_malloc, .realloc = &libc_realloc,
-  .free = &libc_free, .check = &libc_check, .reset_brk = &libc_reset_brk,
+  .free = &libc_free, .memalign = &libc_memalign, .calloc = &libc_calloc,
+  .malloc_hint = &libc_malloc_hint,
+  .usable_size = &libc_malloc_usable_size,
+  .malloc_batch = &libc_malloc_batch, .free_batch = &libc_free_batch,
+  .reserve = &libc_reserve,
+  .check = &libc_check, .reset_brk = &libc_reset_brk,
   .heap_lo = &libc_heap_lo, .heap_hi = &libc_heap_hi};
 
 int my_init();
 void * my_malloc(size_t size);
 void * my_realloc(void *ptr, size_t size);
 void my_free(void *ptr);
+void * my_memalign(size_t alignment, size_t size);
+void * my_calloc(size_t nmemb, size_t size);
+void * my_malloc_hint(size_t size, unsigned hint);
+size_t my_malloc_usable_size(void *ptr);
+size_t my_malloc_batch(size_t size, size_t n, void **ptrs);
+void my_free_batch(void **ptrs, size_t n);
+int my_reserve(const size_t *sizes, const size_t *counts, size_t n);
 int my_check();
 void my_reset_brk();
 void * my_heap_lo();
 void * my_heap_hi();
 
+// Entry points with the C11 and POSIX signatures, built on my_memalign
+void * my_aligned_alloc(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+// Size feedback: how big a request really comes back, and a malloc that
+// tells the caller
+size_t my_malloc_good_size(size_t size);
+void * my_malloc_at_least(size_t size, size_t *actual);
+
+// Movable allocations. A handle names a block that my_compact may slide
+// to a new address; my_hlock returns its current address and keeps it
+// there until the matching my_hunlock.
+my_handle_t my_halloc(size_t size);
+void my_hfree(my_handle_t handle);
+void * my_hlock(my_handle_t handle);
+void my_hunlock(my_handle_t handle);
+size_t my_compact(void);
+
+// Optional background thread for merging, trimming and bin upkeep (built
+// with -DBACKGROUND_MAINTENANCE; my_maint_start fails otherwise)
+int my_maint_start(unsigned interval_us);
+void my_maint_stop(void);
+
+// Hand the pages of long-idle large free blocks back to the kernel (built
+// with -DDECAY_PURGE; returns 0 otherwise)
+size_t my_purge(unsigned decay_ms);
+
+// Placement policy: "best", "first", "next" or "address". MY_PLACEMENT in
+// the environment picks the one to start with
+int my_placement_set(const char *name);
+const char * my_placement(void);
+
+// Heap instances, apart from the default heap behind my_malloc. Each lives
+// in one piece of memory: backing bytes mapped with mem_map (and dropped by
+// mem_reset_brk like any other mapping), or a buffer of the caller's.
+// Blocks must go back to the heap they came from; my_heap_owns tells which.
+typedef struct my_heap_t my_heap_t;
+my_heap_t * my_heap_create(size_t backing);
+my_heap_t * my_heap_create_in_buffer(void *buf, size_t len);
+void my_heap_destroy(my_heap_t *h);
+void * my_heap_malloc(my_heap_t *h, size_t size);
+void my_heap_free(my_heap_t *h, void *ptr);
+void * my_heap_realloc(my_heap_t *h, void *ptr, size_t size);
+void * my_heap_calloc(my_heap_t *h, size_t nmemb, size_t size);
+int my_heap_check(const my_heap_t *h);
+int my_heap_owns(const my_heap_t *h, const void *ptr);
+
+// Regions bump-allocate out of chunks taken from the default heap. Their
+// blocks cannot be freed or realloc'd one at a time: my_region_reset drops
+// them all at once, in constant time, and keeps the chunks for reuse,
+// my_region_destroy hands the chunks back.
+my_region_t * my_region_create(void);
+void * my_region_alloc(my_region_t *r, size_t size);
+void my_region_reset(my_region_t *r);
+void my_region_destroy(my_region_t *r);
+
+// Pools of same-sized objects, grown in chunks from the default heap. The
+// objects carry no headers: a free one holds the link to the next in its
+// first word. my_pool_put takes objects of that pool only; my_pool_destroy
+// frees them all.
+typedef struct my_pool_t my_pool_t;
+my_pool_t * my_pool_create(size_t obj_size, size_t align);
+void * my_pool_get(my_pool_t *p);
+void my_pool_put(my_pool_t *p, void *obj);
+void my_pool_destroy(my_pool_t *p);
+
 static const malloc_impl_t my_impl =
 { .init = &my_init, .malloc = &my_malloc, .realloc = &my_realloc,
-  .free = &my_free, .check = &my_check, .reset_brk = &my_reset_brk,
-  .heap_lo = &my_heap_lo, .heap_hi = &my_heap_hi};
+  .free = &my_free, .memalign = &my_memalign, .calloc = &my_calloc,
+  .malloc_hint = &my_malloc_hint,
+  .usable_size = &my_malloc_usable_size,
+  .malloc_batch = &my_malloc_batch, .free_batch = &my_free_batch,
+  .reserve = &my_reserve,
+  .check = &my_check, .reset_brk = &my_reset_brk,
+  .heap_lo = &my_heap_lo, .heap_hi = &my_heap_hi,
+  .region_create = &my_region_create, .region_alloc = &my_region_alloc,
+  .region_reset = &my_region_reset, .region_destroy = &my_region_destroy,
+  .halloc = &my_halloc, .hfree = &my_hfree, .hlock = &my_hlock,
+  .hunlock = &my_hunlock, .compact = &my_compact};
 
 int bad_init();
 void * bad_malloc(size_t size);
 void * bad_realloc(void *ptr, size_t size);
 void bad_free(void *ptr);
+void * bad_memalign(size_t alignment, size_t size);
+void * bad_calloc(size_t nmemb, size_t size);
+void * bad_malloc_hint(size_t size, unsigned hint);
+size_t bad_malloc_usable_size(void *ptr);
+size_t bad_malloc_batch(size_t size, size_t n, void **ptrs);
+void bad_free_batch(void **ptrs, size_t n);
+int bad_reserve(const size_t *sizes, const size_t *counts, size_t n);
 int bad_check();
 void bad_reset_brk();
 void * bad_heap_lo();
@@ -80,7 +210,12 @@ void * bad_heap_hi();
 
 static const malloc_impl_t bad_impl =
 { .init = &bad_init, .malloc = &bad_malloc, .realloc = &bad_realloc,
-  .free = &bad_free, .check = &bad_check, .reset_brk = &bad_reset_brk,
+  .free = &bad_free, .memalign = &bad_memalign, .calloc = &bad_calloc,
+  .malloc_hint = &bad_malloc_hint,
+  .usable_size = &bad_malloc_usable_size,
+  .malloc_batch = &bad_malloc_batch, .free_batch = &bad_free_batch,
+  .reserve = &bad_reserve,
+  .check = &bad_check, .reset_brk = &bad_reset_brk,
   .heap_lo = &bad_heap_lo, .heap_hi = &bad_heap_hi};
 
 #endif  // _ALLOCATOR_INTERFACE_H
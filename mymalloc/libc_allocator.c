@@ -20,6 +20,7 @@
  * IN THE SOFTWARE.
  **/
 
+#include <malloc.h>
 #include "./allocator_interface.h"
 
 /* Libc needs no initialization. */
@@ -61,3 +62,50 @@ void * libc_realloc(void *ptr, size_t size) {
 void libc_free(void *ptr) {
   free(ptr);
 }
+
+/*call default calloc */
+void * libc_calloc(size_t nmemb, size_t size) {
+  return calloc(nmemb, size);
+}
+
+/*libc takes no hints, call default malloc */
+void * libc_malloc_hint(size_t size, unsigned hint) {
+  return malloc(size);
+}
+
+/*call default malloc_usable_size */
+size_t libc_malloc_usable_size(void *ptr) {
+  return malloc_usable_size(ptr);
+}
+
+/*libc has no batch interface, call malloc n times */
+size_t libc_malloc_batch(size_t size, size_t n, void **ptrs) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    if ((ptrs[i] = malloc(size)) == NULL) {
+      break;
+    }
+  }
+  return i;
+}
+
+/*call free n times */
+void libc_free_batch(void **ptrs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    free(ptrs[i]);
+  }
+}
+
+/*libc cannot be pre-warmed, do nothing */
+int libc_reserve(const size_t *sizes, const size_t *counts, size_t n) {
+  return 0;
+}
+
+/*call default posix_memalign */
+void * libc_memalign(size_t alignment, size_t size) {
+  void *p;
+  if (posix_memalign(&p, alignment, size) != 0) {
+    return NULL;
+  }
+  return p;
+}
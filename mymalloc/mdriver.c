@@ -12,6 +12,12 @@
 
 #include "./mdriver.h"
 #include "./validator.h"
+#include "./kernels.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #ifdef GET_RUNNINGTIME
 #include "./fasttime.h"
@@ -44,6 +50,14 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* If set, run the mm maintenance thread alongside each trace (-m) */
+static int run_maint = 0;
+
+/* If set, eval_mm_speed records how long each call into the package takes
+ * in nanoseconds, counting them in op_count (see eval_mm_latency) */
+static uint64_t *op_nanos = NULL;
+static int op_count;
+
 static const char xor_constant = 0x7B;
 
 /*********************
@@ -53,18 +67,42 @@ static const char xor_constant = 0x7B;
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static void warm_trace(trace_t *trace);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracenum);
 static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace);
+static void maint_begin(void);
+static void maint_end(void);
 static void eval_my_speed(trace_t *trace) {
+  maint_begin();
   eval_mm_speed(&my_impl, trace);
+  maint_end();
 }
 static void eval_libc_speed(trace_t *trace) {
   eval_mm_speed(&libc_impl, trace);
 }
 static int eval_mm_check(const malloc_impl_t *impl, trace_t *trace, int tracenum);
+static void eval_my_warm(trace_t *trace) {
+  mem_reset_brk();
+  my_impl.init();
+  my_impl.reserve(trace->warm_sizes, trace->warm_counts, trace->num_warm);
+}
+static double eval_mm_stream(const malloc_impl_t *impl);
+static void eval_mm_pool(void);
+static void eval_mm_pages(trace_t *trace, char *tracefile);
+static void eval_mm_latency(trace_t *trace, char *tracefile);
+static void eval_mm_kernels(trace_t *trace, char *tracefile);
+static void eval_kernels(void);
+
+/* The mm placement policies compared by -P */
+#define NUM_PLACEMENTS 4
+static const char *placements[NUM_PLACEMENTS] = {"best", "first", "next", "address"};
+static void eval_mm_placement(trace_t *trace, int tracenum, char *tracefile,
+                              double *util, double *rate);
+static void eval_mm_regions(trace_t *trace, int tracenum, char *tracefile);
+static int eval_mm_heaps(trace_t *trace, int tracenum, char *tracefile);
 
 /* Various helper routines */
 static void printresults(int n, char **tracefiles, stats_t *stats);
@@ -89,6 +127,20 @@ int main(int argc, char **argv) {
   int run_bad = 0;     /* If set, run bad malloc (set by -b) */
   int check_heap = 0;  /* If set, run the student heap checker (set by -c) */
   int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+  int run_stream = 0;  /* If set, run the streaming microbenchmark (-s) */
+  int run_pool = 0;    /* If set, run the pool microbenchmark (-o) */
+  int warm = 0;        /* If set, pre-warm the mm heap for each trace (-w) */
+  int resident = 0;    /* If set, report the mm heap's resident size (-r) */
+  int pages = 0;       /* If set, compare base and huge heap pages (-H) */
+  int latency = 0;     /* If set, report mm per-call latencies (-l) */
+  size_t prefault = 0; /* Fault in this far past the mm break (-p) */
+  int prefault_async = 0; /* If set, from a helper thread (-a) */
+  int compare_placement = 0; /* If set, run every placement policy (-P) */
+  int compare_regions = 0; /* If set, run region traces both ways (-R) */
+  int compare_kernels = 0; /* If set, compare copy kernels with libc (-K) */
+  int spread_heaps = 0; /* If set, also run traces over heap instances (-I) */
+  double placement_util[NUM_PLACEMENTS] = {0};
+  double placement_rate[NUM_PLACEMENTS] = {0};
 
   /* temporaries used to compute the performance index */
   double total_throughput, total_util, average_util, average_throughput, p1, p2, perfindex;
@@ -97,7 +149,7 @@ int main(int argc, char **argv) {
   /*
    * Read and interpret the command line arguments
    */
-  while ((c = getopt(argc, argv, "f:t:hvVgcb")) != EOF) {
+  while ((c = getopt(argc, argv, "f:t:p:hvVgcbswmrHlaPRKIo")) != EOF) {
     switch (c) {
       case 'g': /* Generate summary info for the autograder */
         autograder = 1;
@@ -123,6 +175,45 @@ int main(int argc, char **argv) {
       case 'c':
         check_heap = 1;
         break;
+      case 's': /* Stream several same-sized buffers at once */
+        run_stream = 1;
+        break;
+      case 'o': /* Churn same-sized objects through malloc and a pool */
+        run_pool = 1;
+        break;
+      case 'w': /* Reserve each trace's size histogram before running it */
+        warm = 1;
+        break;
+      case 'm': /* Let the mm maintenance thread run during each trace */
+        run_maint = 1;
+        break;
+      case 'r': /* Show how much of the heap is resident after each trace */
+        resident = 1;
+        break;
+      case 'H': /* Run each trace on base pages and on huge pages */
+        pages = 1;
+        break;
+      case 'l': /* Time each call into the mm package */
+        latency = 1;
+        break;
+      case 'p': /* Fault in the mm heap this many KB past the break */
+        prefault = (size_t)atol(optarg) << 10;
+        break;
+      case 'a': /* Let a helper thread do the pre-faulting */
+        prefault_async = 1;
+        break;
+      case 'P': /* Run each trace under every placement policy */
+        compare_placement = 1;
+        break;
+      case 'R': /* Run region traces with regions and with per-object frees */
+        compare_regions = 1;
+        break;
+      case 'K': /* Run realloc traces on the copy kernels and on libc */
+        compare_kernels = 1;
+        break;
+      case 'I': /* Spread each trace over the default heap and instances */
+        spread_heaps = 1;
+        break;
       case 'v': /* Print per-trace performance breakdown */
         verbose = 1;
         break;
@@ -214,6 +305,14 @@ int main(int argc, char **argv) {
 
   /* Initialize the simulated memory system in memlib.c */
   mem_init();
+  if (verbose || pages) {
+    static const char *backing[] = {"base pages", "transparent huge pages",
+                                    "reserved huge pages"};
+    printf("mm heap on %s\n", backing[mem_is_huge()]);
+  }
+  if (prefault > 0 && mem_prefault(prefault, prefault_async) < 0) {
+    printf("prefault: no helper thread, faulting in from mem_sbrk\n");
+  }
 
   /*
    * Optionally run and evaluate the bad malloc package
@@ -265,32 +364,111 @@ int main(int argc, char **argv) {
   for (i = 0; i < num_tracefiles; i++) {
     trace = read_trace(tracedir, tracefiles[i]);
     mm_stats[i].ops = trace->num_ops;
+    if (warm) {
+      warm_trace(trace);
+    }
     if (verbose > 1) {
       printf("Checking mm_malloc for correctness, ");
     }
     mm_stats[i].valid = eval_mm_valid(&my_impl, trace, i);
     if (check_heap) {
+      maint_begin();
       mm_stats[i].checked = eval_mm_check(&my_impl, trace, i);
+      maint_end();
     }
     if (mm_stats[i].valid) {
       if (verbose > 1) {
         printf("efficiency, ");
       }
+      maint_begin();
       mm_stats[i].util = eval_mm_util(&my_impl, trace, i);
+      maint_end();
+      if (verbose && trace->trimmed > 0) {
+        printf("%s: compacts trimmed %zu bytes\n", tracefiles[i], trace->trimmed);
+      }
+      if (resident) {
+        /* Every trace frees all it allocates, so ideally nothing is left */
+        size_t end_bytes = mem_resident();
+        my_purge(0);
+        printf("resident %s: peak %zu KB, at end %zu KB, after purge %zu KB\n",
+               tracefiles[i], mem_heap_peak() >> 10, end_bytes >> 10,
+               mem_resident() >> 10);
+      }
       if (verbose > 1) {
         printf("and performance.\n");
       }
       mm_stats[i].secs = fsecs((void (*)(void *))eval_my_speed, trace);
+      if (warm) {
+        /* Startup is not what is being timed: take the reserve back out */
+        double warm_secs = fsecs((void (*)(void *))eval_my_warm, trace);
+        if (warm_secs < mm_stats[i].secs) {
+          mm_stats[i].secs -= warm_secs;
+        }
+      }
+      if (pages) {
+        eval_mm_pages(trace, tracefiles[i]);
+      }
+      if (latency) {
+        eval_mm_latency(trace, tracefiles[i]);
+      }
+      if (compare_placement) {
+        eval_mm_placement(trace, i, tracefiles[i], placement_util, placement_rate);
+      }
+      if (compare_regions && trace->num_regions > 0) {
+        eval_mm_regions(trace, i, tracefiles[i]);
+      }
+      if (compare_kernels && trace->num_reallocs > 0) {
+        eval_mm_kernels(trace, tracefiles[i]);
+      }
+      if (spread_heaps && !eval_mm_heaps(trace, i, tracefiles[i])) {
+        mm_stats[i].valid = 0;
+      }
     }
     free_trace(trace);
   }
 
+  if (compare_placement && num_tracefiles > 0) {
+    printf("placement average:");
+    for (int k = 0; k < NUM_PLACEMENTS; k++) {
+      printf("%s %s %.1f%% %.0f Kops/s", (k == 0) ? "" : " |", placements[k],
+             100.0 * placement_util[k] / num_tracefiles,
+             placement_rate[k] / num_tracefiles);
+    }
+    printf("\n");
+  }
+
+  /*
+   * Optionally stream same-sized buffers from both packages, to show how
+   * well their large blocks spread out over the cache sets
+   */
+  if (run_stream) {
+    double libc_rate = eval_mm_stream(&libc_impl);
+    double my_rate = eval_mm_stream(&my_impl);
+    printf("stream (%d x %d KB): libc %.2f GB/s, mm %.2f GB/s\n",
+           STREAM_BUFFERS, STREAM_BYTES >> 10, libc_rate / 1e9, my_rate / 1e9);
+  }
+
+  /*
+   * Optionally time the copy kernels against memcpy/memset on their own,
+   * below and above the size where they take over
+   */
+  if (compare_kernels) {
+    eval_kernels();
+  }
+
+  /*
+   * Optionally churn same-sized objects through my_malloc and a pool
+   */
+  if (run_pool) {
+    eval_mm_pool();
+  }
+
   /* Free the simulated heap block. */
   mem_deinit();
 
   /* Display the mm results in a compact table */
   if (verbose) {
-    printf("\nResults for mm malloc:\n");
+    printf("\nResults for mm malloc (%d-byte alignment):\n", R_ALIGNMENT);
     printresults(num_tracefiles, tracefiles, mm_stats);
     printf("\n");
   }
@@ -343,6 +521,7 @@ int main(int argc, char **argv) {
   if (autograder) {
     printf("correct:%d\n", numcorrect);
     printf("perfidx:%f\n", perfindex);
+    printf("alignment:%d\n", R_ALIGNMENT);
   }
 
   if (errors != 0) {
@@ -379,9 +558,18 @@ static trace_t *read_trace(char *tracedir, char *filename) {
   trace_t *trace;
   char type[MAXLINE];
   char path[MAXLINE];
-  unsigned index, size;
+  char line[MAXLINE];
+  char hint[MAXLINE];
+  unsigned index, count;
+  size_t size, alignment;
   unsigned max_index = 0;
   unsigned op_index;
+  unsigned region;
+  int *region_head = NULL;  /* last id allocated in each region... */
+  int *id_next;             /* ... and the one allocated before each id */
+  int num_region_ids = 0;
+  int *handle_locks;        /* locks on each live handle id, or -1... */
+  int num_handle_ids = 0, max_handle_ids = 0;  /* ... listed at compacts */
 
   if (verbose > 1) {
     printf("Reading tracefile: %s\n", filename);
@@ -410,6 +598,11 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     unix_error("malloc 2 failed in read_trace");
   }
 
+  /* Nothing is reserved unless the trace is warmed */
+  trace->num_warm = 0;
+  trace->warm_sizes = NULL;
+  trace->warm_counts = NULL;
+
   /* We'll keep an array of pointers to the allocated blocks here... */
   if ((trace->blocks =
        (char **)malloc(trace->num_ids * sizeof(char *))) == NULL) {
@@ -422,32 +615,196 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     unix_error("malloc 4 failed in read_trace");
   }
 
+  trace->num_reallocs = 0;
+
+  /* Each region allocation is dropped by at most one reset or destroy */
+  trace->num_regions = 0;
+  trace->regions = NULL;
+  if ((trace->region_ids = (int *)malloc(trace->num_ops * sizeof(int))) == NULL ||
+      (id_next = (int *)malloc(trace->num_ids * sizeof(int))) == NULL) {
+    unix_error("malloc 5 failed in read_trace");
+  }
+
+  /* Each compact lists the handle ids live at that point */
+  trace->handle_ids = NULL;
+  trace->trimmed = 0;
+  if ((trace->handles =
+       (my_handle_t *)malloc(trace->num_ids * sizeof(my_handle_t))) == NULL ||
+      (handle_locks = (int *)malloc(trace->num_ids * sizeof(int))) == NULL) {
+    unix_error("malloc 7 failed in read_trace");
+  }
+  for (int id = 0; id < trace->num_ids; id++) {
+    handle_locks[id] = -1;
+  }
+
   /* read every request line in the trace file */
   index = 0;
   op_index = 0;
   while (fscanf(tracefile, "%s", type) != EOF) {
     switch (type[0]) {
       case 'a':
-        fscanf(tracefile, "%u %u", &index, &size);
+        /* "a <id> <size> [s|l]": an optional lifetime hint ends the line */
+        fscanf(tracefile, "%u %zu", &index, &size);
         trace->ops[op_index].type = ALLOC;
         trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
+        trace->ops[op_index].hint = MY_HINT_NONE;
+        if (fgets(line, MAXLINE, tracefile) != NULL &&
+            sscanf(line, "%s", hint) == 1) {
+          if (hint[0] == 's') {
+            trace->ops[op_index].hint = MY_HINT_SHORT_LIVED;
+          } else if (hint[0] == 'l') {
+            trace->ops[op_index].hint = MY_HINT_LONG_LIVED;
+          } else {
+            printf("Bogus hint (%s) in tracefile %s\n", hint, path);
+            exit(1);
+          }
+        }
         max_index = (index > max_index) ? index : max_index;
         break;
       case 'r':
-        fscanf(tracefile, "%u %u", &index, &size);
+        fscanf(tracefile, "%u %zu", &index, &size);
         trace->ops[op_index].type = REALLOC;
         trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
+        trace->num_reallocs++;
         max_index = (index > max_index) ? index : max_index;
         break;
+      case 'c':
+        fscanf(tracefile, "%u %zu", &index, &size);
+        trace->ops[op_index].type = CALLOC;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+      case 'm':
+        fscanf(tracefile, "%u %zu %zu", &index, &alignment, &size);
+        trace->ops[op_index].type = MEMALIGN;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].alignment = alignment;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+      case 'b':
+        /* "ba <first> <count> <size>" or "bf <first> <count>" */
+        if (type[1] == 'a') {
+          fscanf(tracefile, "%u %u %zu", &index, &count, &size);
+          trace->ops[op_index].type = BATCH_ALLOC;
+          trace->ops[op_index].size = size;
+        } else if (type[1] == 'f') {
+          fscanf(tracefile, "%u %u", &index, &count);
+          trace->ops[op_index].type = BATCH_FREE;
+        } else {
+          printf("Bogus batch type (%s) in tracefile %s\n", type, path);
+          exit(1);
+        }
+        assert(count > 0);
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].count = count;
+        max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+        break;
+      case 'R':
+        /* "Rn <region>", "Ra <region> <id> <size>", "Rr <region>" or
+         * "Rd <region>". A reset or destroy drops every id allocated in
+         * the region since it was created or last reset. */
+        fscanf(tracefile, "%u", &region);
+        if (region >= (unsigned)trace->num_regions) {
+          region_head = (int *)realloc(region_head, (region + 1) * sizeof(int));
+          if (region_head == NULL) {
+            unix_error("realloc failed in read_trace");
+          }
+          while ((unsigned)trace->num_regions <= region) {
+            region_head[trace->num_regions++] = -1;
+          }
+        }
+        trace->ops[op_index].region = region;
+        if (type[1] == 'n') {
+          trace->ops[op_index].type = REGION_NEW;
+        } else if (type[1] == 'a') {
+          fscanf(tracefile, "%u %zu", &index, &size);
+          assert((int)index < trace->num_ids);
+          trace->ops[op_index].type = REGION_ALLOC;
+          trace->ops[op_index].index = index;
+          trace->ops[op_index].size = size;
+          id_next[index] = region_head[region];
+          region_head[region] = index;
+          max_index = (index > max_index) ? index : max_index;
+        } else if (type[1] == 'r' || type[1] == 'd') {
+          trace->ops[op_index].type = (type[1] == 'r') ? REGION_RESET : REGION_DESTROY;
+          trace->ops[op_index].index = num_region_ids;
+          trace->ops[op_index].count = 0;
+          for (int id = region_head[region]; id != -1; id = id_next[id]) {
+            trace->region_ids[num_region_ids++] = id;
+            trace->ops[op_index].count++;
+          }
+          region_head[region] = -1;
+        } else {
+          printf("Bogus region type (%s) in tracefile %s\n", type, path);
+          exit(1);
+        }
+        break;
+      case 'h':
+        /* "ha <id> <size>", "hf <id>", "hl <id>", "hu <id>" or "hc". A
+         * compact lists every live handle id, the locked ones first. */
+        if (type[1] == 'a') {
+          fscanf(tracefile, "%u %zu", &index, &size);
+          assert((int)index < trace->num_ids);
+          trace->ops[op_index].type = HANDLE_ALLOC;
+          trace->ops[op_index].size = size;
+          handle_locks[index] = 0;
+          max_index = (index > max_index) ? index : max_index;
+        } else if (type[1] == 'f' || type[1] == 'l' || type[1] == 'u') {
+          fscanf(tracefile, "%u", &index);
+          assert((int)index < trace->num_ids && handle_locks[index] >= 0);
+          if (type[1] == 'f') {
+            trace->ops[op_index].type = HANDLE_FREE;
+            handle_locks[index] = -1;
+          } else if (type[1] == 'l') {
+            trace->ops[op_index].type = HANDLE_LOCK;
+            handle_locks[index]++;
+          } else {
+            assert(handle_locks[index] > 0);
+            trace->ops[op_index].type = HANDLE_UNLOCK;
+            handle_locks[index]--;
+          }
+        } else if (type[1] == 'c') {
+          trace->ops[op_index].type = COMPACT;
+          index = num_handle_ids;
+          trace->ops[op_index].count = 0;
+          trace->ops[op_index].locked = 0;
+          for (int pass = 0; pass < 2; pass++) {
+            for (int id = 0; id < trace->num_ids; id++) {
+              if ((pass == 0) ? handle_locks[id] <= 0 : handle_locks[id] != 0) {
+                continue;
+              }
+              if (num_handle_ids == max_handle_ids) {
+                max_handle_ids = 2 * max_handle_ids + 16;
+                trace->handle_ids = (int *)realloc(trace->handle_ids,
+                                                   max_handle_ids * sizeof(int));
+                if (trace->handle_ids == NULL) {
+                  unix_error("realloc failed in read_trace");
+                }
+              }
+              trace->handle_ids[num_handle_ids++] = id;
+              trace->ops[op_index].count++;
+            }
+            if (pass == 0) {
+              trace->ops[op_index].locked = trace->ops[op_index].count;
+            }
+          }
+        } else {
+          printf("Bogus handle type (%s) in tracefile %s\n", type, path);
+          exit(1);
+        }
+        trace->ops[op_index].index = index;
+        break;
       case 'f':
         fscanf(tracefile, "%ud", &index);
         trace->ops[op_index].type = FREE;
         trace->ops[op_index].index = index;
         break;
       case 'w':
-        fscanf(tracefile, "%u %u", &index, &size);
+        fscanf(tracefile, "%u %zu", &index, &size);
         trace->ops[op_index].type = WRITE;
         trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
@@ -460,6 +817,14 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     op_index++;
   }
   fclose(tracefile);
+  free(region_head);
+  free(id_next);
+  free(handle_locks);
+  if (trace->num_regions > 0 &&
+      (trace->regions = (my_region_t **)calloc(trace->num_regions,
+                                               sizeof(my_region_t *))) == NULL) {
+    unix_error("malloc 6 failed in read_trace");
+  }
   assert((int) max_index == trace->num_ids - 1);
   assert(trace->num_ops == (int) op_index);
 
@@ -474,9 +839,122 @@ void free_trace(trace_t *trace) {
   free(trace->ops);         /* free the three arrays... */
   free(trace->blocks);
   free(trace->block_sizes);
+  free(trace->warm_sizes);
+  free(trace->warm_counts);
+  free(trace->regions);
+  free(trace->region_ids);
+  free(trace->handles);
+  free(trace->handle_ids);
   free(trace);              /* and the trace record itself... */
 }
 
+static int compare_sizes(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * warm_trace - Work out the size histogram that reserve should be given
+ *   before the trace runs: for every size that malloc, calloc or a batch
+ *   asks for, the most blocks of that size that are ever live at once.
+ *   Sizes seen fewer than WARM_MIN_COUNT times at once are left out, and
+ *   the rest are scaled down to fit the trace's peak live bytes, so that
+ *   a trace of one-off sizes does not reserve far more than it ever uses.
+ */
+static void warm_trace(trace_t *trace) {
+  size_t n = 0;
+  size_t *sizes, *live, *held;
+  size_t live_bytes = 0, peak_bytes = 0, warm_bytes = 0;
+  int *slot;
+  int i;
+  unsigned j;
+
+  /* Collect the distinct sizes. An id can be allocated again once freed,
+   * so there may be more allocations than ids, but never more than ops */
+  if ((sizes = (size_t *)malloc(trace->num_ops * sizeof(size_t))) == NULL)
+    unix_error("malloc 1 failed in warm_trace");
+  for (i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+    if (op->type == ALLOC || op->type == CALLOC || op->type == BATCH_ALLOC) {
+      sizes[n++] = op->size;
+    }
+  }
+  qsort(sizes, n, sizeof(size_t), compare_sizes);
+  size_t distinct = 0;
+  for (size_t k = 0; k < n; k++) {
+    if (distinct == 0 || sizes[k] != sizes[distinct - 1])
+      sizes[distinct++] = sizes[k];
+  }
+
+  /* Replay the trace, counting live blocks of each size */
+  live = (size_t *)calloc(distinct + 1, sizeof(size_t));
+  trace->warm_counts = (size_t *)calloc(distinct + 1, sizeof(size_t));
+  slot = (int *)malloc(trace->num_ids * sizeof(int));
+  held = (size_t *)calloc(trace->num_ids, sizeof(size_t)); /* bytes live per id */
+  if (live == NULL || trace->warm_counts == NULL || slot == NULL || held == NULL)
+    unix_error("malloc 2 failed in warm_trace");
+  for (i = 0; i < trace->num_ids; i++)
+    slot[i] = -1;
+
+  for (i = 0; i < trace->num_ops; i++) {
+    traceop_t *op = &trace->ops[i];
+    unsigned first = op->index;
+    unsigned count = (op->type == BATCH_ALLOC || op->type == BATCH_FREE) ? op->count : 1;
+    for (j = first; j < first + count; j++) {
+      switch (op->type) {
+        case ALLOC:
+        case CALLOC:
+        case BATCH_ALLOC: {
+          size_t *found = (size_t *)bsearch(&op->size, sizes, distinct,
+                                            sizeof(size_t), compare_sizes);
+          int k = found - sizes;
+          slot[j] = k;
+          if (++live[k] > trace->warm_counts[k])
+            trace->warm_counts[k] = live[k];
+          live_bytes += op->size;
+          held[j] = op->size;
+          if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+          break;
+        }
+        case FREE:
+        case REALLOC:
+        case BATCH_FREE:
+          /* A realloc'd block no longer has its reserved size */
+          if (slot[j] >= 0) {
+            live[slot[j]]--;
+            slot[j] = -1;
+          }
+          /* but its new size still counts towards the peak */
+          live_bytes -= held[j];
+          held[j] = (op->type == REALLOC) ? op->size : 0;
+          live_bytes += held[j];
+          if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  for (size_t k = 0; k < distinct; k++) {
+    if (trace->warm_counts[k] < WARM_MIN_COUNT)
+      trace->warm_counts[k] = 0;
+    warm_bytes += trace->warm_counts[k] * sizes[k];
+  }
+  if (warm_bytes > peak_bytes) {
+    for (size_t k = 0; k < distinct; k++)
+      trace->warm_counts[k] = trace->warm_counts[k] * peak_bytes / warm_bytes;
+  }
+
+  trace->num_warm = distinct;
+  trace->warm_sizes = sizes;
+  free(live);
+  free(slot);
+  free(held);
+}
+
 /**********************************************************************
  * The following functions evaluate the space utilization and
  * throughput of the libc and mm malloc packages.
@@ -487,16 +965,17 @@ void free_trace(trace_t *trace) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace.
+ *   largest size the heap reached (counting pages mapped for large
+ *   blocks) while running the student's malloc package on the trace.
  *
  */
 static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
   int i;
   int index;
-  int size, newsize, oldsize;
-  int max_total_size = 0;
-  int total_size = 0;
+  unsigned count;
+  size_t size, newsize, oldsize;
+  size_t max_total_size = 0;
+  size_t total_size = 0;
   size_t heap_size = 0;
   char *p;
   char *newp, *oldp;
@@ -506,14 +985,26 @@ static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracen
   if (impl->init() < 0) {
     app_error("init failed in eval_mm_util");
   }
+  impl->reserve(trace->warm_sizes, trace->warm_counts, trace->num_warm);
 
   for (i = 0; i < trace->num_ops; i++) {
     switch (trace->ops[i].type) {
       case ALLOC: /* alloc */
+      case MEMALIGN: /* memalign */
+      case CALLOC: /* calloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = (char *) impl->malloc(size)) == NULL) {
+        if (trace->ops[i].type == MEMALIGN) {
+          p = (char *) impl->memalign(trace->ops[i].alignment, size);
+        } else if (trace->ops[i].type == CALLOC) {
+          p = (char *) impl->calloc(1, size);
+        } else if (trace->ops[i].hint != MY_HINT_NONE) {
+          p = (char *) impl->malloc_hint(size, trace->ops[i].hint);
+        } else {
+          p = (char *) impl->malloc(size);
+        }
+        if (p == NULL) {
           app_error("malloc failed in eval_mm_util");
         }
 
@@ -545,7 +1036,7 @@ static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracen
 
         /* Keep track of current total size
          * of all allocated blocks */
-        total_size += (newsize - oldsize);
+        total_size = total_size - oldsize + newsize;
 
         /* Update statistics */
         max_total_size = (total_size > max_total_size) ?
@@ -565,6 +1056,91 @@ static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracen
 
         break;
 
+      case BATCH_ALLOC: /* batch of mallocs */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        count = trace->ops[i].count;
+
+        if (impl->malloc_batch(size, count, (void **)&trace->blocks[index]) != count) {
+          app_error("malloc_batch failed in eval_mm_util");
+        }
+        for (unsigned j = 0; j < count; j++) {
+          trace->block_sizes[index + j] = size;
+        }
+
+        total_size += count * size;
+        max_total_size = (total_size > max_total_size) ?
+            total_size : max_total_size;
+        break;
+
+      case BATCH_FREE: /* batch of frees */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        for (unsigned j = 0; j < count; j++) {
+          total_size -= trace->block_sizes[index + j];
+        }
+        impl->free_batch((void **)&trace->blocks[index], count);
+        break;
+
+      case REGION_NEW: /* new region */
+        if (!trace_region_new(impl, trace, &trace->ops[i]))
+          app_error("region_create failed in eval_mm_util");
+        break;
+
+      case REGION_ALLOC: /* alloc from a region */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = trace_region_alloc(impl, trace, &trace->ops[i])) == NULL)
+          app_error("region_alloc failed in eval_mm_util");
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        total_size += size;
+        max_total_size = (total_size > max_total_size) ?
+            total_size : max_total_size;
+        break;
+
+      case REGION_RESET: /* drop a region's blocks */
+      case REGION_DESTROY:
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        for (unsigned j = 0; j < count; j++) {
+          total_size -= trace->block_sizes[trace->region_ids[index + j]];
+        }
+        trace_region_drop(impl, trace, &trace->ops[i]);
+        break;
+
+      case HANDLE_ALLOC: /* movable alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = trace_handle_alloc(impl, trace, index, size)) == NULL)
+          app_error("halloc failed in eval_mm_util");
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        total_size += size;
+        max_total_size = (total_size > max_total_size) ?
+            total_size : max_total_size;
+        break;
+
+      case HANDLE_FREE: /* free a movable block */
+        index = trace->ops[i].index;
+        total_size -= trace->block_sizes[index];
+        trace_handle_free(impl, trace, index);
+        break;
+
+      case HANDLE_LOCK: /* pin a movable block */
+        index = trace->ops[i].index;
+        trace->blocks[index] = trace_handle_lock(impl, trace, index);
+        break;
+
+      case HANDLE_UNLOCK: /* unpin it */
+        trace_handle_unlock(impl, trace, trace->ops[i].index);
+        break;
+
+      case COMPACT: /* move the unlocked blocks */
+        if (impl->compact != NULL)
+          trace->trimmed += impl->compact();
+        break;
+
       case WRITE: /* write */
         break;
 
@@ -574,7 +1150,7 @@ static double eval_mm_util(const malloc_impl_t *impl, trace_t *trace, int tracen
   }
   max_total_size = (max_total_size > MEM_ALLOWANCE) ?
     max_total_size : MEM_ALLOWANCE;
-  heap_size = mem_heapsize();
+  heap_size = mem_heap_peak();
   heap_size = (heap_size > MEM_ALLOWANCE) ?
     heap_size : MEM_ALLOWANCE;
   return ((double)max_total_size / (double)heap_size);
@@ -584,12 +1160,589 @@ static void mem_op(volatile char *raddr, volatile char *waddr) {
   *waddr = *raddr ^ xor_constant;
 }
 
+/*
+ * stream_pass - Sum all but the first buffer into the first one. The
+ *    buffers are walked a tile at a time, STREAM_PASSES times over each
+ *    tile, so that the data would stay in L1 if the tiles did not fight
+ *    over the same cache sets.
+ */
+static void stream_pass(double **bufs) {
+  const size_t n = STREAM_BYTES / sizeof(double);
+  const size_t tile = STREAM_TILE / sizeof(double);
+  for (size_t t = 0; t < n; t += tile) {
+    for (int pass = 0; pass < STREAM_PASSES; pass++) {
+      for (size_t j = t; j < t + tile; j++) {
+        double sum = 0;
+        for (int b = 1; b < STREAM_BUFFERS; b++) {
+          sum += bufs[b][j];
+        }
+        bufs[0][j] = sum;
+      }
+    }
+  }
+}
+
+/*
+ * eval_mm_stream - Allocate STREAM_BUFFERS buffers back to back and
+ *    return how many bytes per second stream_pass moves through them
+ */
+static double eval_mm_stream(const malloc_impl_t *impl) {
+  double *bufs[STREAM_BUFFERS];
+
+  mem_reset_brk();
+  if (impl->init() < 0) {
+    app_error("init failed in eval_mm_stream");
+  }
+  for (int b = 0; b < STREAM_BUFFERS; b++) {
+    if ((bufs[b] = (double *) impl->malloc(STREAM_BYTES)) == NULL) {
+      app_error("malloc error in eval_mm_stream");
+    }
+    for (size_t j = 0; j < STREAM_BYTES / sizeof(double); j++) {
+      bufs[b][j] = b + j;
+    }
+  }
+
+  double secs = fsecs((void (*)(void *))stream_pass, bufs);
+
+  for (int b = 0; b < STREAM_BUFFERS; b++) {
+    impl->free(bufs[b]);
+  }
+  return (double)STREAM_PASSES * STREAM_BUFFERS * STREAM_BYTES / secs;
+}
+
+/*
+ * The objects of the pool microbenchmark, and the pool they come from
+ * (NULL to use my_malloc and my_free)
+ */
+typedef struct {
+  my_pool_t *pool;
+  char *objs[POOL_OBJECTS];
+} pool_bench_t;
+
+/*
+ * pool_churn - Replace every object POOL_ROUNDS times over, in a scattered
+ *    order, touching each new one
+ */
+static void pool_churn(pool_bench_t *b) {
+  for (int round = 0; round < POOL_ROUNDS; round++) {
+    for (size_t i = 0; i < POOL_OBJECTS; i++) {
+      size_t j = (i * 2053 + round) % POOL_OBJECTS;
+      if (b->pool != NULL) {
+        my_pool_put(b->pool, b->objs[j]);
+        b->objs[j] = (char *) my_pool_get(b->pool);
+      } else {
+        my_free(b->objs[j]);
+        b->objs[j] = (char *) my_malloc(POOL_OBJECT_BYTES);
+      }
+      if (b->objs[j] == NULL) {
+        app_error("allocation error in pool_churn");
+      }
+      b->objs[j][0] = (char)j;
+    }
+  }
+}
+
+/*
+ * eval_mm_pool - Keep POOL_OBJECTS objects live, from my_malloc and then
+ *    from a pool, and print how fast each replaces them and how much of
+ *    the heap they fill
+ */
+static void eval_mm_pool(void) {
+  static pool_bench_t b;
+  double rate[2], util[2];
+
+  for (int k = 0; k < 2; k++) {
+    mem_reset_brk();
+    if (my_init() < 0) {
+      app_error("init failed in eval_mm_pool");
+    }
+    b.pool = NULL;
+    if (k == 1 && (b.pool = my_pool_create(POOL_OBJECT_BYTES, 0)) == NULL) {
+      app_error("my_pool_create failed in eval_mm_pool");
+    }
+    for (size_t i = 0; i < POOL_OBJECTS; i++) {
+      b.objs[i] = (char *) ((b.pool != NULL) ? my_pool_get(b.pool) : my_malloc(POOL_OBJECT_BYTES));
+      if (b.objs[i] == NULL) {
+        app_error("allocation error in eval_mm_pool");
+      }
+    }
+    double secs = fsecs((void (*)(void *))pool_churn, &b);
+    rate[k] = (double)POOL_ROUNDS * POOL_OBJECTS * 2 / secs / 1e6;
+    util[k] = (double)POOL_OBJECTS * POOL_OBJECT_BYTES / mem_heapsize();
+  }
+  printf("pool (%d x %d B): malloc %.0f Mops/s %.0f%% | pool %.0f Mops/s %.0f%%\n",
+         POOL_OBJECTS, POOL_OBJECT_BYTES, rate[0], 100.0 * util[0],
+         rate[1], 100.0 * util[1]);
+}
+
+/*
+ * counter_open - Open a disabled perf counter for this thread's user-mode
+ *    events, or return -1 if the kernel or the hardware will not provide it
+ *    (hardware counters are often missing inside virtual machines)
+ */
+static int counter_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * counter_format - Print a counter's value into buf, or "n/a"
+ */
+static char *counter_format(char *buf, size_t len, int fd) {
+  long long count;
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+    snprintf(buf, len, "n/a");
+  } else {
+    snprintf(buf, len, "%lld", count);
+  }
+  return buf;
+}
+
+/*
+ * eval_mm_pages - Run the mm package on a trace with the heap on base
+ *    pages and then on transparent huge pages. For each, count the page
+ *    faults and dTLB load misses of one run from a cold heap and time the
+ *    trace as usual, then print the two side by side.
+ */
+static void eval_mm_pages(trace_t *trace, char *tracefile) {
+  const char *names[2] = {"4K", "2M"};
+  double rate[2];
+  char faults[2][32], misses[2][32];
+
+  for (int huge = 0; huge < 2; huge++) {
+    if (mem_huge_pages(huge) < 0) {
+      printf("pages %s: the kernel refused %s pages\n", tracefile, names[huge]);
+      return;
+    }
+    int fault_fd = counter_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    int tlb_fd = counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    for (int k = 0; k < 2; k++) {
+      int fd = (k == 0) ? fault_fd : tlb_fd;
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+    eval_my_speed(trace);
+    for (int k = 0; k < 2; k++) {
+      int fd = (k == 0) ? fault_fd : tlb_fd;
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+    counter_format(faults[huge], sizeof(faults[huge]), fault_fd);
+    counter_format(misses[huge], sizeof(misses[huge]), tlb_fd);
+    if (fault_fd >= 0) {
+      close(fault_fd);
+    }
+    if (tlb_fd >= 0) {
+      close(tlb_fd);
+    }
+    rate[huge] = trace->num_ops / fsecs((void (*)(void *))eval_my_speed, trace) / 1e3;
+  }
+#ifndef MEM_HUGE_PAGES
+  mem_huge_pages(0);
+#endif
+
+  printf("pages %s: 4K %.0f Kops/s, %s faults, %s dTLB misses | "
+         "2M %.0f Kops/s, %s faults, %s dTLB misses (%+.1f%%)\n",
+         tracefile, rate[0], faults[0], misses[0], rate[1], faults[1], misses[1],
+         100.0 * (rate[1] - rate[0]) / rate[0]);
+}
+
+/*
+ * eval_mm_kernels - Time the mm package on a trace with block_copy and
+ *    block_zero on the vector kernels and then on memcpy/memset, and print
+ *    the two side by side, with how many of the trace's reallocs are big
+ *    enough for the kernels to make any difference
+ */
+static void eval_mm_kernels(trace_t *trace, char *tracefile) {
+  const char *names[2];
+  double rate[2];
+  int big = 0;
+
+  for (int k = 0; k < trace->num_ops; k++) {
+    big += (trace->ops[k].type == REALLOC && trace->ops[k].size >= block_nt_threshold());
+  }
+  for (int libc = 0; libc < 2; libc++) {
+    names[libc] = block_kernels(libc);
+    rate[libc] = trace->num_ops / fsecs((void (*)(void *))eval_my_speed, trace) / 1e3;
+  }
+  block_kernels(0);
+
+  printf("kernels %s: %s %.0f Kops/s | %s %.0f Kops/s (%+.1f%%), "
+         "%d of %d reallocs of %zu KB or more\n",
+         tracefile, names[0], rate[0], names[1], rate[1],
+         100.0 * (rate[0] - rate[1]) / rate[1], big, trace->num_reallocs,
+         block_nt_threshold() >> 10);
+}
+
+/*
+ * One move timed by eval_kernels: a copy from src, or a clear if src is
+ * NULL
+ */
+typedef struct {
+  char *dst;
+  char *src;
+  size_t size;
+} kernel_bench_t;
+
+static void kernel_move(kernel_bench_t *b) {
+  if (b->src != NULL) {
+    block_copy(b->dst, b->src, b->size);
+  } else {
+    block_zero(b->dst, b->size);
+  }
+}
+
+/*
+ * eval_kernels - Print the bytes per second block_copy and block_zero
+ *    move on the vector kernels and on memcpy/memset, for a move a quarter
+ *    of the non-temporal threshold and one four times it
+ */
+static void eval_kernels(void) {
+  const size_t sizes[2] = {block_nt_threshold() / 4, block_nt_threshold() * 4};
+  kernel_bench_t b;
+
+  /* Payloads are 8-byte aligned, and no more */
+  char *dst = (char *) malloc(sizes[1] + 8);
+  char *src = (char *) malloc(sizes[1] + 8);
+  if (dst == NULL || src == NULL) {
+    unix_error("malloc failed in eval_kernels");
+  }
+  memset(src, 0x5A, sizes[1] + 8);
+  memset(dst, 0, sizes[1] + 8);
+
+  for (int zero = 0; zero < 2; zero++) {
+    printf("kernels %s:", zero ? "zero" : "copy");
+    for (int s = 0; s < 2; s++) {
+      const char *names[2];
+      double rate[2];
+      b.dst = dst + 8;
+      b.src = zero ? NULL : src + 8;
+      b.size = sizes[s];
+      for (int libc = 0; libc < 2; libc++) {
+        names[libc] = block_kernels(libc);
+        kernel_move(&b);  /* warm the caches and the branch predictors up */
+        rate[libc] = b.size / fsecs((void (*)(void *))kernel_move, &b);
+      }
+      printf("%s %zu KB %s %.2f GB/s, %s %.2f GB/s", (s == 0) ? "" : " |",
+             b.size >> 10, names[0], rate[0] / 1e9, names[1], rate[1] / 1e9);
+    }
+    printf("\n");
+  }
+  block_kernels(0);
+
+  free(dst);
+  free(src);
+}
+
+static malloc_impl_t per_object_impl;
+
+/* eval_per_object_speed - eval_my_speed with region blocks freed one by one */
+static void eval_per_object_speed(trace_t *trace) {
+  maint_begin();
+  eval_mm_speed(&per_object_impl, trace);
+  maint_end();
+}
+
+/*
+ * eval_mm_regions - Measure the mm package's space utilization and
+ *    throughput on a trace with regions, and again with every region block
+ *    malloc'd and freed on its own, and print them side by side
+ */
+static void eval_mm_regions(trace_t *trace, int tracenum, char *tracefile) {
+  per_object_impl = my_impl;
+  per_object_impl.region_create = NULL;
+
+  maint_begin();
+  double region_util = eval_mm_util(&my_impl, trace, tracenum);
+  maint_end();
+  double region_rate = trace->num_ops / fsecs((void (*)(void *))eval_my_speed, trace) / 1e3;
+  maint_begin();
+  double object_util = eval_mm_util(&per_object_impl, trace, tracenum);
+  maint_end();
+  double object_rate =
+    trace->num_ops / fsecs((void (*)(void *))eval_per_object_speed, trace) / 1e3;
+  printf("regions %s: region %.0f%% %.0f Kops/s | per-object %.0f%% %.0f Kops/s\n",
+         tracefile, 100.0 * region_util, region_rate, 100.0 * object_util, object_rate);
+}
+
+/*
+ * heaps_malloc - Allocate size bytes for a trace id from heap instance k,
+ *    or from the default heap if k is -1 or the instance is full, and
+ *    record in *owner where the block came from. With zero set the block
+ *    comes from calloc.
+ */
+static char *heaps_malloc(my_heap_t **heaps, int k, size_t size, int zero, int *owner) {
+  char *p = NULL;
+  if (k >= 0 && heaps[k] != NULL) {
+    p = (char *) (zero ? my_heap_calloc(heaps[k], 1, size) : my_heap_malloc(heaps[k], size));
+  }
+  if (p == NULL) {
+    k = -1;
+    p = (char *) (zero ? my_calloc(1, size) : my_malloc(size));
+  }
+  *owner = k;
+  return p;
+}
+
+/*
+ * heaps_free - Free a trace block back to the heap that owns it
+ */
+static void heaps_free(my_heap_t **heaps, char *p, int owner) {
+  if (owner < 0) {
+    my_free(p);
+  } else {
+    my_heap_free(heaps[owner], p);
+  }
+}
+
+/*
+ * eval_mm_heaps - Run the mm package on a trace with its ids dealt out in
+ *    turn to the default heap and HEAP_INSTANCES heap instances. Each block
+ *    must be owned by its instance and by no other, and must keep its data
+ *    until it is freed, and every heap must pass its checker after each
+ *    request. Only traces of malloc, calloc, realloc and free are run.
+ *    Returns 0 on failure, and 1 on pass.
+ */
+static int eval_mm_heaps(trace_t *trace, int tracenum, char *tracefile) {
+  my_heap_t *heaps[HEAP_INSTANCES];
+  size_t placed[HEAP_INSTANCES + 1] = {0};
+  int *owner;
+  int ok = 1;
+
+  for (int i = 0; i < trace->num_ops; i++) {
+    traceop_type type = trace->ops[i].type;
+    if (type != ALLOC && type != CALLOC && type != REALLOC &&
+        type != FREE && type != WRITE) {
+      printf("heaps %s: skipped, not just malloc and free\n", tracefile);
+      return 1;
+    }
+  }
+  if ((owner = (int *)malloc(trace->num_ids * sizeof(int))) == NULL) {
+    unix_error("malloc failed in eval_mm_heaps");
+  }
+
+  /* Reset the heap and make the instances. If one cannot be made its
+   * blocks land in the default heap. */
+  mem_reset_brk();
+  if (my_init() < 0) {
+    app_error("init failed in eval_mm_heaps");
+  }
+  for (int k = 0; k < HEAP_INSTANCES; k++) {
+    heaps[k] = my_heap_create(HEAP_INSTANCE_BYTES);
+  }
+
+  for (int i = 0; ok && i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    size_t size = trace->ops[i].size;
+    char *p, *oldp;
+
+    /* The block freed or resized must still hold its id */
+    if (trace->ops[i].type == REALLOC || trace->ops[i].type == FREE) {
+      oldp = trace->blocks[index];
+      for (size_t j = 0; j < trace->block_sizes[index]; j++) {
+        if (oldp[j] != (char)index) {
+          malloc_error(tracenum, i, "block lost its data in a heap instance.");
+          ok = 0;
+          break;
+        }
+      }
+    }
+    if (!ok) {
+      break;
+    }
+
+    switch (trace->ops[i].type) {
+      case ALLOC: /* malloc */
+      case CALLOC: /* calloc */
+        p = heaps_malloc(heaps, index % (HEAP_INSTANCES + 1) - 1, size,
+                         trace->ops[i].type == CALLOC, &owner[index]);
+        if (p == NULL) {
+          app_error("malloc failed in eval_mm_heaps");
+        }
+        for (size_t j = 0; trace->ops[i].type == CALLOC && j < size; j++) {
+          if (p[j] != 0) {
+            malloc_error(tracenum, i, "calloc block in a heap instance is not zero.");
+            ok = 0;
+            break;
+          }
+        }
+        break;
+
+      case REALLOC: /* realloc, within the block's own heap if it can */
+        oldp = trace->blocks[index];
+        if (owner[index] < 0) {
+          p = (char *) my_realloc(oldp, size);
+        } else if ((p = (char *) my_heap_realloc(heaps[owner[index]], oldp, size)) == NULL) {
+          /* The instance is full: move the block to the default heap */
+          int k = owner[index];
+          p = heaps_malloc(heaps, -1, size, 0, &owner[index]);
+          if (p != NULL) {
+            memcpy(p, oldp, (size < trace->block_sizes[index]) ?
+                   size : trace->block_sizes[index]);
+            my_heap_free(heaps[k], oldp);
+          }
+        }
+        if (p == NULL) {
+          app_error("realloc failed in eval_mm_heaps");
+        }
+        break;
+
+      case FREE: /* free */
+        heaps_free(heaps, trace->blocks[index], owner[index]);
+        p = NULL;
+        break;
+
+      default: /* write */
+        p = NULL;
+        break;
+    }
+
+    /* A new block belongs to its own heap only, and is filled with its id */
+    if (p != NULL) {
+      for (int k = 0; k < HEAP_INSTANCES; k++) {
+        if (heaps[k] != NULL && my_heap_owns(heaps[k], p) != (owner[index] == k)) {
+          malloc_error(tracenum, i, "block owned by the wrong heap instance.");
+          ok = 0;
+        }
+      }
+      memset(p, (char)index, size);
+      trace->blocks[index] = p;
+      trace->block_sizes[index] = size;
+      placed[owner[index] + 1]++;
+    }
+
+    if (my_check() < 0) {
+      malloc_error(tracenum, i, "default heap check failed.");
+      ok = 0;
+    }
+    for (int k = 0; k < HEAP_INSTANCES; k++) {
+      if (heaps[k] != NULL && my_heap_check(heaps[k]) < 0) {
+        malloc_error(tracenum, i, "heap instance check failed.");
+        ok = 0;
+      }
+    }
+  }
+
+  for (int k = 0; k < HEAP_INSTANCES; k++) {
+    if (heaps[k] != NULL) {
+      my_heap_destroy(heaps[k]);
+    }
+  }
+  free(owner);
+  printf("heaps %s: %zu blocks in the default heap", tracefile, placed[0]);
+  for (int k = 0; k < HEAP_INSTANCES; k++) {
+    printf(", %zu in instance %d", placed[k + 1], k);
+  }
+  printf("%s\n", ok ? "" : " (failed)");
+  return ok;
+}
+
+/*
+ * eval_mm_placement - Measure the mm package's space utilization and
+ *    throughput on a trace under each placement policy in turn, print them
+ *    side by side and add them to the running totals in util and rate
+ *    (Kops/s). The policy in use before is put back afterwards.
+ */
+static void eval_mm_placement(trace_t *trace, int tracenum, char *tracefile,
+                              double *util, double *rate) {
+  const char *current = my_placement();
+
+  printf("placement %s:", tracefile);
+  for (int k = 0; k < NUM_PLACEMENTS; k++) {
+    if (my_placement_set(placements[k]) < 0) {
+      app_error("unknown placement policy in eval_mm_placement");
+    }
+    maint_begin();
+    double u = eval_mm_util(&my_impl, trace, tracenum);
+    maint_end();
+    double r = trace->num_ops / fsecs((void (*)(void *))eval_my_speed, trace) / 1e3;
+    printf("%s %s %.0f%% %.0f Kops/s", (k == 0) ? "" : " |", placements[k], 100.0 * u, r);
+    util[k] += u;
+    rate[k] += r;
+  }
+  printf("\n");
+  my_placement_set(current);
+}
+
+/*
+ * compare_nanos - qsort comparator for op_nanos
+ */
+static int compare_nanos(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_latency - Run the mm package once on a trace, starting from a
+ *    heap with none of its pages faulted in, and time every call into the
+ *    package (the writes to the blocks are left out). Print the median,
+ *    tail and worst of those times next to the page faults taken, which is
+ *    where the tail comes from unless the heap is pre-faulted (-p).
+ */
+static void eval_mm_latency(trace_t *trace, char *tracefile) {
+  if ((op_nanos = (uint64_t *)malloc(trace->num_ops * sizeof(uint64_t))) == NULL) {
+    unix_error("op_nanos malloc in eval_mm_latency failed");
+  }
+  op_count = 0;
+  mem_evict();
+
+  int fault_fd = counter_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+  if (fault_fd >= 0) {
+    ioctl(fault_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fault_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  eval_my_speed(trace);
+  char faults[32];
+  if (fault_fd >= 0) {
+    ioctl(fault_fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+  counter_format(faults, sizeof(faults), fault_fd);
+  if (fault_fd >= 0) {
+    close(fault_fd);
+  }
+
+  if (op_count > 0) {
+    qsort(op_nanos, op_count, sizeof(uint64_t), compare_nanos);
+    printf("latency %s: %d calls, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, "
+           "max %llu ns, %s faults\n", tracefile, op_count,
+           (unsigned long long)op_nanos[op_count / 2],
+           (unsigned long long)op_nanos[(int)(op_count * 0.99)],
+           (unsigned long long)op_nanos[(int)(op_count * 0.999)],
+           (unsigned long long)op_nanos[op_count - 1], faults);
+  }
+  free(op_nanos);
+  op_nanos = NULL;
+}
+
+/*
+ * now_nanos - Read the monotonic clock, for timing single calls
+ */
+static inline uint64_t now_nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace) {
-  int i, index, size, newsize;
+  int i, index;
+  size_t size, newsize;
   char *p, *newp, *oldp, *block;
 
   /* Reset the heap and initialize the mm package */
@@ -597,18 +1750,40 @@ static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace) {
   if (impl->init() < 0) {
     app_error("init failed in eval_mm_speed");
   }
+  impl->reserve(trace->warm_sizes, trace->warm_counts, trace->num_warm);
 
   /* Interpret each trace request */
   for (i = 0; i < trace->num_ops; i++) {
+    uint64_t start = (op_nanos != NULL) ? now_nanos() : 0;
     switch (trace->ops[i].type) {
       case ALLOC: /* malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = (char *) impl->malloc(size)) == NULL)
+        if (trace->ops[i].hint != MY_HINT_NONE)
+          p = (char *) impl->malloc_hint(size, trace->ops[i].hint);
+        else
+          p = (char *) impl->malloc(size);
+        if (p == NULL)
           app_error("malloc error in eval_mm_speed");
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = (char *) impl->memalign(trace->ops[i].alignment, size)) == NULL)
+          app_error("memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case CALLOC: /* calloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = (char *) impl->calloc(1, size)) == NULL)
+          app_error("calloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -624,13 +1799,67 @@ static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace) {
         impl->free(block);
         break;
 
+      case BATCH_ALLOC: /* batch of mallocs */
+        index = trace->ops[i].index;
+        if (impl->malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                               (void **)&trace->blocks[index]) != trace->ops[i].count)
+          app_error("malloc_batch error in eval_mm_speed");
+        break;
+
+      case BATCH_FREE: /* batch of frees */
+        index = trace->ops[i].index;
+        impl->free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+        break;
+
+      case REGION_NEW: /* new region */
+        if (!trace_region_new(impl, trace, &trace->ops[i]))
+          app_error("region_create error in eval_mm_speed");
+        break;
+
+      case REGION_ALLOC: /* alloc from a region */
+        index = trace->ops[i].index;
+        if ((p = trace_region_alloc(impl, trace, &trace->ops[i])) == NULL)
+          app_error("region_alloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case REGION_RESET: /* drop a region's blocks */
+      case REGION_DESTROY:
+        trace_region_drop(impl, trace, &trace->ops[i]);
+        break;
+
+      case HANDLE_ALLOC: /* movable alloc */
+        index = trace->ops[i].index;
+        if ((p = trace_handle_alloc(impl, trace, index, trace->ops[i].size)) == NULL)
+          app_error("halloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case HANDLE_FREE: /* free a movable block */
+        trace_handle_free(impl, trace, trace->ops[i].index);
+        break;
+
+      case HANDLE_LOCK: /* pin a movable block */
+        index = trace->ops[i].index;
+        trace->blocks[index] = trace_handle_lock(impl, trace, index);
+        break;
+
+      case HANDLE_UNLOCK: /* unpin it */
+        trace_handle_unlock(impl, trace, trace->ops[i].index);
+        break;
+
+      case COMPACT: /* move the unlocked blocks */
+        if (impl->compact != NULL)
+          impl->compact();
+        break;
+
       case WRITE: /* write */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
         p = trace->blocks[index];
         if (size > 1) {
           /* read bytes, do some computation, and write */
-          for (int offset = 1; offset < size; offset++) {
+          for (size_t offset = 1; offset < size; offset++) {
             mem_op(p + offset - 1, p + offset);
           }
         }
@@ -639,6 +1868,9 @@ static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace) {
       default:
         app_error("Nonexistent request type in eval_mm_speed");
     }
+    if (op_nanos != NULL && trace->ops[i].type != WRITE) {
+      op_nanos[op_count++] = now_nanos() - start;
+    }
   }
 }
 
@@ -647,7 +1879,8 @@ static void eval_mm_speed(const malloc_impl_t *impl, trace_t *trace) {
  *    implementation.  Returns 0 on check failure, and 1 on pass.
  */
 static int eval_mm_check(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
-  int i, index, size, newsize;
+  int i, index;
+  size_t size, newsize;
   char *p, *newp, *oldp, *block;
 
   /* Reset the heap and initialize the mm package */
@@ -655,19 +1888,45 @@ static int eval_mm_check(const malloc_impl_t *impl, trace_t *trace, int tracenum
   if (impl->init() < 0) {
     malloc_error(tracenum, 0, "impl init failed.");
   }
+  impl->reserve(trace->warm_sizes, trace->warm_counts, trace->num_warm);
   /* Interpret each trace request */
   for (i = 0; i < trace->num_ops; i++) {
     switch (trace->ops[i].type) {
       case ALLOC: /* malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = (char *) impl->malloc(size)) == NULL) {
+        if (trace->ops[i].hint != MY_HINT_NONE) {
+          p = (char *) impl->malloc_hint(size, trace->ops[i].hint);
+        } else {
+          p = (char *) impl->malloc(size);
+        }
+        if (p == NULL) {
           malloc_error(tracenum, i, "impl malloc failed.");
           return 0;
         }
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = (char *) impl->memalign(trace->ops[i].alignment, size)) == NULL) {
+          malloc_error(tracenum, i, "impl memalign failed.");
+          return 0;
+        }
+        trace->blocks[index] = p;
+        break;
+
+      case CALLOC: /* calloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = (char *) impl->calloc(1, size)) == NULL) {
+          malloc_error(tracenum, i, "impl calloc failed.");
+          return 0;
+        }
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -685,6 +1944,68 @@ static int eval_mm_check(const malloc_impl_t *impl, trace_t *trace, int tracenum
         impl->free(block);
         break;
 
+      case BATCH_ALLOC: /* batch of mallocs */
+        index = trace->ops[i].index;
+        if (impl->malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                               (void **)&trace->blocks[index]) != trace->ops[i].count) {
+          malloc_error(tracenum, i, "impl malloc_batch failed.");
+          return 0;
+        }
+        break;
+
+      case BATCH_FREE: /* batch of frees */
+        index = trace->ops[i].index;
+        impl->free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+        break;
+
+      case REGION_NEW: /* new region */
+        if (!trace_region_new(impl, trace, &trace->ops[i])) {
+          malloc_error(tracenum, i, "impl region_create failed.");
+          return 0;
+        }
+        break;
+
+      case REGION_ALLOC: /* alloc from a region */
+        index = trace->ops[i].index;
+        if ((p = trace_region_alloc(impl, trace, &trace->ops[i])) == NULL) {
+          malloc_error(tracenum, i, "impl region_alloc failed.");
+          return 0;
+        }
+        trace->blocks[index] = p;
+        break;
+
+      case REGION_RESET: /* drop a region's blocks */
+      case REGION_DESTROY:
+        trace_region_drop(impl, trace, &trace->ops[i]);
+        break;
+
+      case HANDLE_ALLOC: /* movable alloc */
+        index = trace->ops[i].index;
+        if ((p = trace_handle_alloc(impl, trace, index, trace->ops[i].size)) == NULL) {
+          malloc_error(tracenum, i, "impl halloc failed.");
+          return 0;
+        }
+        trace->blocks[index] = p;
+        break;
+
+      case HANDLE_FREE: /* free a movable block */
+        trace_handle_free(impl, trace, trace->ops[i].index);
+        break;
+
+      case HANDLE_LOCK: /* pin a movable block */
+        index = trace->ops[i].index;
+        trace->blocks[index] = trace_handle_lock(impl, trace, index);
+        break;
+
+      case HANDLE_UNLOCK: /* unpin it */
+        trace_handle_unlock(impl, trace, trace->ops[i].index);
+        break;
+
+      case COMPACT: /* move the unlocked blocks */
+        if (impl->compact != NULL)
+          impl->compact();
+        break;
+
       case WRITE: /* write */
         break;
 
@@ -789,11 +2110,115 @@ void malloc_error(int tracenum, int opnum, char *msg) {
   printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * trace_region_new - Create the region of a REGION_NEW request. There is
+ *    nothing to create for an impl without regions. Returns 0 on failure.
+ */
+int trace_region_new(const malloc_impl_t *impl, trace_t *trace, traceop_t *op) {
+  if (impl->region_create == NULL) {
+    return 1;
+  }
+  trace->regions[op->region] = impl->region_create();
+  return trace->regions[op->region] != NULL;
+}
+
+/*
+ * trace_region_alloc - Carry out a REGION_ALLOC request: from its region,
+ *    or with malloc for an impl without regions
+ */
+char *trace_region_alloc(const malloc_impl_t *impl, trace_t *trace, traceop_t *op) {
+  if (impl->region_create == NULL) {
+    return (char *) impl->malloc(op->size);
+  }
+  return (char *) impl->region_alloc(trace->regions[op->region], op->size);
+}
+
+/*
+ * trace_region_drop - Carry out a REGION_RESET or REGION_DESTROY request.
+ *    An impl without regions frees the blocks allocated since the last
+ *    reset one at a time instead.
+ */
+void trace_region_drop(const malloc_impl_t *impl, trace_t *trace, traceop_t *op) {
+  if (impl->region_create == NULL) {
+    for (unsigned k = 0; k < op->count; k++) {
+      impl->free(trace->blocks[trace->region_ids[op->index + k]]);
+    }
+  } else if (op->type == REGION_RESET) {
+    impl->region_reset(trace->regions[op->region]);
+  } else {
+    impl->region_destroy(trace->regions[op->region]);
+    trace->regions[op->region] = NULL;
+  }
+}
+
+/*
+ * trace_handle_alloc - Carry out a HANDLE_ALLOC request for id and return
+ *    the block's address, which holds until the next compact. An impl
+ *    without handles mallocs a block that stays put.
+ */
+char *trace_handle_alloc(const malloc_impl_t *impl, trace_t *trace, int id, size_t size) {
+  if (impl->halloc == NULL) {
+    return (char *) impl->malloc(size);
+  }
+  if ((trace->handles[id] = impl->halloc(size)) == 0) {
+    return NULL;
+  }
+  char *p = (char *) impl->hlock(trace->handles[id]);
+  impl->hunlock(trace->handles[id]);
+  return p;
+}
+
+/*
+ * trace_handle_free - Carry out a HANDLE_FREE request for id
+ */
+void trace_handle_free(const malloc_impl_t *impl, trace_t *trace, int id) {
+  if (impl->halloc == NULL) {
+    impl->free(trace->blocks[id]);
+  } else {
+    impl->hfree(trace->handles[id]);
+  }
+}
+
+/*
+ * trace_handle_lock, trace_handle_unlock - Lock id's block and return its
+ *    current address, and unlock it again. trace->blocks[id] is left to
+ *    the caller to update.
+ */
+char *trace_handle_lock(const malloc_impl_t *impl, trace_t *trace, int id) {
+  if (impl->halloc == NULL) {
+    return trace->blocks[id];
+  }
+  return (char *) impl->hlock(trace->handles[id]);
+}
+
+void trace_handle_unlock(const malloc_impl_t *impl, trace_t *trace, int id) {
+  if (impl->halloc != NULL) {
+    impl->hunlock(trace->handles[id]);
+  }
+}
+
+/*
+ * maint_begin, maint_end - Bracket one run of the mm package with its
+ *    maintenance thread, if -m asked for it. The thread is stopped before
+ *    the heap is reset for the next run.
+ */
+static void maint_begin(void) {
+  if (run_maint && my_maint_start(MAINT_INTERVAL_US) < 0) {
+    unix_error("my_maint_start failed (build with MAINT=1)");
+  }
+}
+
+static void maint_end(void) {
+  if (run_maint) {
+    my_maint_stop();
+  }
+}
+
 /*
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hvVgc] [-f <file>] [-t <dir>]\n");
+  fprintf(stderr, "Usage: mdriver [-hvVgcswmrHlaPRKIo] [-f <file>] [-t <dir>] [-p <KB>]\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
   fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
@@ -801,5 +2226,18 @@ static void usage(void) {
   fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
   fprintf(stderr, "\t-V         Print additional debug info.\n");
   fprintf(stderr, "\t-c         Check the heap after every operation.\n");
+  fprintf(stderr, "\t-s         Run the streaming microbenchmark.\n");
+  fprintf(stderr, "\t-o         Run the fixed-size object pool microbenchmark.\n");
+  fprintf(stderr, "\t-w         Pre-warm the heap from each trace's sizes.\n");
+  fprintf(stderr, "\t-m         Run the mm maintenance thread (MAINT=1 builds).\n");
+  fprintf(stderr, "\t-r         Report the mm heap's resident size (PURGE=1 builds purge).\n");
+  fprintf(stderr, "\t-H         Compare the mm heap on base pages and huge pages.\n");
+  fprintf(stderr, "\t-l         Report the latency of each call into mm from a cold heap.\n");
+  fprintf(stderr, "\t-p <KB>    Keep the mm heap faulted in <KB> past its break.\n");
+  fprintf(stderr, "\t-a         Fault the mm heap in from a helper thread (with -p).\n");
+  fprintf(stderr, "\t-P         Compare the mm placement policies.\n");
+  fprintf(stderr, "\t-R         Compare mm regions with freeing each object.\n");
+  fprintf(stderr, "\t-K         Compare the copy kernels with memcpy/memset on realloc traces.\n");
+  fprintf(stderr, "\t-I         Spread each trace over mm heap instances too.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
 }
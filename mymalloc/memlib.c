@@ -25,6 +25,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -32,6 +33,7 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "./memlib.h"
 #include "./config.h"
@@ -40,46 +42,240 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */
+static char *mem_clean_brk;  /* highest mem_brk, as of when it last came down */
+static char *mem_commit_brk; /* end of the part of the heap mapped read-write */
+static size_t mem_map_len;   /* length of the mapping behind the brk heap */
+static int mem_huge;         /* MEM_HUGE_* kind of pages behind the brk heap */
+
+/* Size of a transparent huge page. The heap mapping is aligned to it so
+ * that every 2 MB stretch of the heap can be backed by one. */
+#define MEM_HUGE_PAGE ((size_t)2 << 20)
+
+/* The heap is committed in steps of this many bytes as mem_sbrk grows it.
+ * A huge page, so that each step can be backed by one. */
+#define MEM_COMMIT_STEP MEM_HUGE_PAGE
+
+/* Pre-faulting (see mem_prefault). The pages from the break up to
+ * mem_fault_brk have been faulted in; the helper thread, when there is
+ * one, works its way up to mem_fault_goal. All of it is under
+ * mem_fault_lock while the thread runs. */
+static size_t mem_prefault_dist;  /* how far past the break, 0 for off */
+static char *mem_fault_brk;
+static char *mem_fault_goal;
+static int mem_fault_async;       /* set while the helper thread runs */
+static int mem_fault_stop;
+static pthread_t mem_fault_thread;
+static pthread_mutex_t mem_fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_fault_wake = PTHREAD_COND_INITIALIZER;
+
+static void mem_prefault_ahead(void);
+static void mem_fault_lower(char *addr);
+
+/*
+ * mem_commit - make the heap readable and writable up to at least hi.
+ *    Returns 0 on success, or -1 if the kernel refused.
+ */
+static int mem_commit(char *hi) {
+  if (hi <= mem_commit_brk) {
+    return 0;
+  }
+  size_t len = (size_t)(hi - mem_commit_brk + MEM_COMMIT_STEP - 1) & ~(MEM_COMMIT_STEP - 1);
+  if (len > (size_t)(mem_start_brk + mem_map_len - mem_commit_brk)) {
+    len = (size_t)(mem_start_brk + mem_map_len - mem_commit_brk);
+  }
+  if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) != 0) {
+    return -1;
+  }
+  mem_commit_brk += len;
+  return 0;
+}
+
+/* Pages handed out by mem_map live outside the brk heap. We remember each
+ * mapping so that mem_reset_brk can drop them and so that they count
+ * towards the heap size. */
+typedef struct mem_mapping_t {
+  char *addr;
+  size_t len;
+  struct mem_mapping_t *next;
+} mem_mapping_t;
+
+static mem_mapping_t *mem_mappings;  /* live mappings, most recent first */
+static size_t mem_mapped_bytes;      /* total length of live mappings */
+static size_t mem_peak;              /* largest heap size, as of when it last shrank */
+
+/*
+ * mem_note_size - remember the highest break and the largest heap size
+ *    seen so far. Growing the heap leaves them alone, as mem_heap_clean
+ *    and mem_heap_peak also look at where it is now, so only what shrinks
+ *    it has to call this, first.
+ */
+static void mem_note_size(void) {
+  size_t size = mem_heapsize();
+  if (size > mem_peak) {
+    mem_peak = size;
+  }
+  if (mem_brk > mem_clean_brk) {
+    mem_clean_brk = mem_brk;
+  }
+}
+
+/*
+ * mem_find_mapping - return the link that points to the mapping at addr
+ */
+static mem_mapping_t **mem_find_mapping(char *addr) {
+  mem_mapping_t **link = &mem_mappings;
+  while (*link != NULL && (*link)->addr != addr) {
+    link = &(*link)->next;
+  }
+  assert(*link != NULL);
+  return link;
+}
+
+#if defined(MEM_HUGETLB) && defined(MAP_HUGETLB)
+/*
+ * mem_hugetlb_free - bytes of reserved huge pages that are free right
+ *    now, from /proc/meminfo, or 0 if there are none or it cannot be read.
+ *    The size of one of them goes to *page.
+ */
+static size_t mem_hugetlb_free(size_t *page) {
+  FILE *f = fopen("/proc/meminfo", "r");
+  char line[128];
+  size_t pages = 0, page_kb = 0;
+  *page = 0;
+  if (f == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "HugePages_Free: %zu", &pages);
+    sscanf(line, "Hugepagesize: %zu kB", &page_kb);
+  }
+  fclose(f);
+  *page = page_kb << 10;
+  return pages * *page;
+}
+#endif
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
-    exit(1);
+  /* reserve the address space we will use to model the available VM.
+   * Nothing is committed until mem_sbrk reaches it (see mem_commit), so
+   * this costs the same for any MAX_HEAP. Pages are only backed once
+   * touched, come zeroed, and can be handed back to the kernel with
+   * madvise (see mem_purge). */
+  mem_map_len = (MAX_HEAP + MEM_HUGE_PAGE - 1) & ~(MEM_HUGE_PAGE - 1);
+  mem_start_brk = MAP_FAILED;
+  mem_huge = MEM_HUGE_NONE;
+#if defined(MEM_HUGETLB) && defined(MAP_HUGETLB)
+  /* Reserved huge pages: as many as the system has free, up to
+   * MEM_HUGETLB_MAX and MAX_HEAP. No MAP_NORESERVE here: the reservation
+   * is what makes mmap fail up front instead of touching a page raising
+   * SIGBUS later. Past them mem_sbrk runs out, and the heap carries on in
+   * segments. Without any, the heap quietly takes an ordinary mapping;
+   * mem_is_huge tells which one it got. */
+  size_t huge_page;
+  size_t huge_len = mem_hugetlb_free(&huge_page);
+  if (huge_len > MEM_HUGETLB_MAX) {
+    huge_len = MEM_HUGETLB_MAX;
+  }
+  if (huge_len > mem_map_len) {
+    huge_len = mem_map_len;
+  }
+  if (huge_page > 0) {
+    huge_len -= huge_len % huge_page;
+  }
+  if (huge_len > 0) {
+    mem_start_brk = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (mem_start_brk != MAP_FAILED) {
+    mem_map_len = huge_len;
+    mem_huge = MEM_HUGE_RESERVED;
+    mem_commit_brk = mem_start_brk + mem_map_len;
+  }
+#endif
+  if (mem_start_brk == MAP_FAILED) {
+    /* Over-map by a huge page and trim both ends to align the start */
+    char *addr = mmap(NULL, mem_map_len + MEM_HUGE_PAGE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "mem_init_vm: mmap error\n");
+      exit(1);
+    }
+    size_t lead = -(uintptr_t)addr & (MEM_HUGE_PAGE - 1);
+    if (lead > 0) {
+      munmap(addr, lead);
+    }
+    munmap(addr + lead + mem_map_len, MEM_HUGE_PAGE - lead);
+    mem_start_brk = addr + lead;
+    mem_commit_brk = mem_start_brk;
+#ifdef MEM_HUGE_PAGES
+    mem_huge_pages(1);
+#endif
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+  /* max legal heap address */
+  mem_max_addr = mem_start_brk + (MAX_HEAP < mem_map_len ? MAX_HEAP
+                                                          : mem_map_len);
   mem_brk = mem_start_brk;                  /* heap is empty initially */
+  mem_clean_brk = mem_start_brk;            /* and all of it is zero */
+  mem_fault_brk = mem_start_brk;            /* with nothing faulted in */
+#ifdef MEM_PREFAULT
+#ifdef MEM_PREFAULT_THREAD
+  mem_prefault(MEM_PREFAULT, 1);
+#else
+  mem_prefault(MEM_PREFAULT, 0);
+#endif
+#endif
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  free(mem_start_brk);
+  mem_prefault(0, 0);  /* stops the helper thread */
+  mem_reset_brk();     /* drops the mappings */
+  munmap(mem_start_brk, mem_map_len);
 }
 
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
 void mem_reset_brk(void) {
+  mem_note_size();
   mem_brk = mem_start_brk;
+
+  while (mem_mappings != NULL) {
+    mem_mapping_t *m = mem_mappings;
+    mem_mappings = m->next;
+    munmap(m->addr, m->len);
+    free(m);
+  }
+  mem_mapped_bytes = 0;
+  mem_peak = 0;
+  mem_prefault_ahead();
 }
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ * mem_sbrk_try - simple model of the sbrk function. Extends the heap
+ *    by incr bytes and returns the start address of the new area, or
+ *    NULL, quietly, if there is no room for it. A negative incr gives the
+ *    top of the heap back, as long as it does not reach below the first
+ *    byte; whole pages given back are purged.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk_try(intptr_t incr) {
+  if (incr < 0) {
+    mem_note_size();
+  }
   char *old_brk = __sync_fetch_and_add(&mem_brk, incr);
 
-  if ((incr < 0) || (mem_brk > mem_max_addr)) {
+  /* compare against the room left rather than the new brk, so that a huge
+   * incr cannot wrap the pointer around */
+  if ((incr < 0) ? ((size_t)-incr > (size_t)(old_brk - mem_start_brk))
+                 : ((size_t)incr > (size_t)(mem_max_addr - old_brk) ||
+                    mem_commit(old_brk + incr) < 0)) {
     errno = ENOMEM;
-    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory... (%ld)\n", mem_heapsize());
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-value"
@@ -88,12 +284,342 @@ void *mem_sbrk(int incr) {
 
 #pragma GCC diagnostic pop
 
-    return (void *)-1;
+    return NULL;
   }
 
+  if (incr < 0) {
+    mem_purge(mem_brk, (size_t)-incr);
+    mem_fault_lower(mem_brk);
+  } else {
+    mem_prefault_ahead();
+  }
   return (void *)old_brk;
 }
 
+/*
+ * mem_sbrk - mem_sbrk_try for a caller with nowhere else to go: running
+ *    out is an error, reported on stderr, and returns (void *)-1 like sbrk
+ */
+void *mem_sbrk(intptr_t incr) {
+  void *p = mem_sbrk_try(incr);
+  if (p == NULL) {
+    mem_out_of_memory();
+    return (void *)-1;
+  }
+  return p;
+}
+
+/*
+ * mem_out_of_memory - report that the heap has run out of memory for good
+ */
+void mem_out_of_memory(void) {
+  fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory... (%zu)\n", mem_heapsize());
+}
+
+/*
+ * mem_map - map len bytes (a multiple of the page size) of fresh, zeroed
+ *    pages outside the brk heap. Returns NULL if the system is out of
+ *    memory.
+ */
+void *mem_map(size_t len) {
+  char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+
+  mem_mapping_t *m = (mem_mapping_t *)malloc(sizeof(mem_mapping_t));
+  if (m == NULL) {
+    munmap(addr, len);
+    return NULL;
+  }
+  m->addr = addr;
+  m->len = len;
+  m->next = mem_mappings;
+  mem_mappings = m;
+  mem_mapped_bytes += len;
+  return addr;
+}
+
+/*
+ * mem_unmap - give back a mapping made by mem_map or mem_remap
+ */
+void mem_unmap(void *addr, size_t len) {
+  mem_mapping_t **link = mem_find_mapping((char *)addr);
+  mem_mapping_t *m = *link;
+  assert(m->len == len);
+
+  mem_note_size();
+  *link = m->next;
+  mem_mapped_bytes -= m->len;
+  munmap(m->addr, m->len);
+  free(m);
+}
+
+/*
+ * mem_remap - grow or shrink a mapping to new_len bytes. The kernel moves
+ *    the pages rather than copying them, so this costs about one system
+ *    call whatever the size. Returns the (possibly new) address, or NULL
+ *    if the mapping could not be resized, in which case it is untouched.
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len) {
+  mem_mapping_t *m = *mem_find_mapping((char *)addr);
+  assert(m->len == old_len);
+
+  char *new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+  if (new_addr == MAP_FAILED) {
+    return NULL;
+  }
+  mem_note_size();
+  m->addr = new_addr;
+  m->len = new_len;
+  mem_mapped_bytes = mem_mapped_bytes - old_len + new_len;
+  return new_addr;
+}
+
+/*
+ * mem_purge - give the whole pages inside [addr, addr + len) back to the
+ *    kernel while keeping the addresses. With MADV_DONTNEED (the default)
+ *    they read as zero when next touched; building with -DMEM_PURGE_LAZY
+ *    uses MADV_FREE, which is cheaper but leaves the old contents in place
+ *    until the kernel actually needs the memory. Returns the number of
+ *    bytes purged.
+ */
+size_t mem_purge(void *addr, size_t len) {
+  /* Purging part of a huge page would only split it */
+  const uintptr_t page = mem_huge ? MEM_HUGE_PAGE : mem_pagesize();
+  uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+  uintptr_t hi = ((uintptr_t)addr + len) & ~(page - 1);
+  if (hi <= lo) {
+    return 0;
+  }
+#ifdef MEM_PURGE_LAZY
+  if (madvise((void *)lo, hi - lo, MADV_FREE) != 0) {
+    return 0;
+  }
+#else
+  if (madvise((void *)lo, hi - lo, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+#endif
+  return hi - lo;
+}
+
+/*
+ * mem_huge_pages - ask for the brk heap to be backed by transparent huge
+ *    pages (on != 0) or by base pages only. The heap's current pages are
+ *    dropped, so that everything is faulted back in at the new size; like
+ *    the heap after mem_reset_brk, its contents should be treated as
+ *    garbage. Returns 0 on success, or -1 if the kernel refused (for
+ *    instance without THP support).
+ */
+int mem_huge_pages(int on) {
+  if (mem_huge == MEM_HUGE_RESERVED) {
+    /* Reserved huge pages are all the mapping can have */
+    return on ? 0 : -1;
+  }
+#ifdef MADV_HUGEPAGE
+  if (madvise(mem_start_brk, mem_map_len, on ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) != 0) {
+    return -1;
+  }
+  mem_huge = on ? MEM_HUGE_TRANSPARENT : MEM_HUGE_NONE;
+  mem_evict();
+  return 0;
+#else
+  (void)on;
+  return -1;
+#endif
+}
+
+/*
+ * mem_is_huge - what the brk heap is backed by: MEM_HUGE_RESERVED for a
+ *    MEM_HUGETLB mapping, MEM_HUGE_TRANSPARENT once transparent huge pages
+ *    have been asked for (the kernel may still hand out base pages), or
+ *    MEM_HUGE_NONE
+ */
+int mem_is_huge(void) {
+  return mem_huge;
+}
+
+/*
+ * mem_evict - drop every page of the brk heap, so that the next run starts
+ *    from a heap that takes its page faults afresh. The heap's contents
+ *    should be treated as garbage afterwards, as after mem_reset_brk.
+ */
+void mem_evict(void) {
+  madvise(mem_start_brk, mem_map_len, MADV_DONTNEED);
+  mem_fault_lower(mem_start_brk);
+  mem_prefault_ahead();
+}
+
+/*
+ * mem_populate - fault in the pages in [lo, hi), which are committed
+ */
+static void mem_populate(char *lo, char *hi) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(lo, (size_t)(hi - lo), MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+#endif
+  /* Older kernels: add zero to a byte of each page. That takes a write
+   * fault but leaves the byte alone, even if the break has just moved past
+   * it and the allocator is writing the same page. */
+  const size_t page = mem_pagesize();
+  for (char *p = lo; p < hi; p += page) {
+    __sync_fetch_and_add(p, 0);
+  }
+}
+
+/*
+ * mem_fault_main - the helper thread: fault in pages up to mem_fault_goal
+ *    whenever it moves past mem_fault_brk
+ */
+static void *mem_fault_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&mem_fault_lock);
+  while (!mem_fault_stop) {
+    if (mem_fault_goal <= mem_fault_brk) {
+      pthread_cond_wait(&mem_fault_wake, &mem_fault_lock);
+      continue;
+    }
+    char *lo = mem_fault_brk;
+    char *hi = mem_fault_goal;
+    pthread_mutex_unlock(&mem_fault_lock);
+    mem_populate(lo, hi);
+    pthread_mutex_lock(&mem_fault_lock);
+    /* Unless the pages were dropped again in the meantime */
+    if (mem_fault_brk == lo) {
+      mem_fault_brk = hi;
+    }
+  }
+  pthread_mutex_unlock(&mem_fault_lock);
+  return NULL;
+}
+
+/*
+ * mem_fault_lower - note that the pages from addr up may no longer be
+ *    faulted in
+ */
+static void mem_fault_lower(char *addr) {
+  if (mem_fault_async) {
+    pthread_mutex_lock(&mem_fault_lock);
+  }
+  if (addr < mem_fault_brk) {
+    mem_fault_brk = addr;
+  }
+  if (mem_fault_async) {
+    /* The thread still has its goal, and now has pages to go back for */
+    pthread_cond_signal(&mem_fault_wake);
+    pthread_mutex_unlock(&mem_fault_lock);
+  }
+}
+
+/*
+ * mem_prefault_ahead - make sure the pages up to mem_prefault_dist past the
+ *    break are faulted in, or that the helper thread is on its way there.
+ *    Nothing is done until less than half the distance is left, so that
+ *    this costs one system call per half distance the heap grows rather
+ *    than one per mem_sbrk.
+ */
+static void mem_prefault_ahead(void) {
+  if (mem_prefault_dist == 0) {
+    return;
+  }
+  char *end = mem_start_brk + mem_map_len;
+  const size_t page = mem_pagesize();
+  char *goal = ((size_t)(end - mem_brk) > mem_prefault_dist) ? mem_brk + mem_prefault_dist : end;
+  goal = (char *)(((uintptr_t)goal + page - 1) & ~(uintptr_t)(page - 1));
+  if (goal > end) {
+    goal = end;
+  }
+  char *low_water = mem_brk + (goal - mem_brk) / 2;
+
+  if (mem_fault_async) {
+    pthread_mutex_lock(&mem_fault_lock);
+    if (mem_fault_goal < low_water && mem_commit(goal) == 0) {
+      mem_fault_goal = goal;
+      pthread_cond_signal(&mem_fault_wake);
+    }
+    pthread_mutex_unlock(&mem_fault_lock);
+  } else if (mem_fault_brk < low_water && mem_commit(goal) == 0) {
+    mem_populate(mem_fault_brk, goal);
+    mem_fault_brk = goal;
+  }
+}
+
+/*
+ * mem_prefault - keep the pages from the break to distance bytes past it
+ *    faulted in, so that the allocator does not take page faults on memory
+ *    it has just grown into. With async != 0 a helper thread does the
+ *    faulting, and mem_sbrk only has to tell it how far to go. A distance
+ *    of 0 turns pre-faulting off. Returns 0 on success, or -1 if the helper
+ *    thread could not be started, in which case mem_sbrk does the faulting
+ *    itself.
+ */
+int mem_prefault(size_t distance, int async) {
+  if (mem_fault_async) {
+    pthread_mutex_lock(&mem_fault_lock);
+    mem_fault_stop = 1;
+    pthread_cond_signal(&mem_fault_wake);
+    pthread_mutex_unlock(&mem_fault_lock);
+    pthread_join(mem_fault_thread, NULL);
+    mem_fault_async = 0;
+  }
+
+  mem_prefault_dist = distance;
+  int ret = 0;
+  if (distance > 0 && async) {
+    mem_fault_stop = 0;
+    mem_fault_goal = mem_fault_brk;
+    if (pthread_create(&mem_fault_thread, NULL, mem_fault_main, NULL) == 0) {
+      mem_fault_async = 1;
+    } else {
+      ret = -1;
+    }
+  }
+  mem_prefault_ahead();
+  return ret;
+}
+
+/*
+ * mem_resident - returns how many bytes of the brk heap are backed by
+ *    memory right now, as opposed to mem_heapsize, which counts address
+ *    space
+ */
+size_t mem_resident(void) {
+  const size_t page = mem_pagesize();
+  const size_t pages = (size_t)(mem_brk - mem_start_brk + page - 1) / page;
+  size_t resident = 0;
+  unsigned char vec[4096];
+  for (size_t done = 0; done < pages; ) {
+    size_t n = pages - done < sizeof(vec) ? pages - done : sizeof(vec);
+    if (mincore(mem_start_brk + done * page, n * page, vec) != 0) {
+      return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+      resident += vec[i] & 1;
+    }
+    done += n;
+  }
+  return resident * page;
+}
+
+/*
+ * mem_contains - returns 1 if [lo, hi] lies inside the brk heap or inside
+ *    a single live mapping, 0 otherwise
+ */
+int mem_contains(void *lo, void *hi) {
+  if ((char *)lo >= mem_start_brk && (char *)hi < mem_brk) {
+    return 1;
+  }
+  for (mem_mapping_t *m = mem_mappings; m != NULL; m = m->next) {
+    if ((char *)lo >= m->addr && (char *)hi < m->addr + m->len) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -110,10 +636,29 @@ void *mem_heap_hi(void) {
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heap_clean - returns the lowest address that mem_sbrk has never
+ *    handed out. Everything from here to the end of the model is zero,
+ *    even after mem_reset_brk.
+ */
+void *mem_heap_clean(void) {
+  return (void *)(mem_brk > mem_clean_brk ? mem_brk : mem_clean_brk);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, counting mapped pages
  */
 size_t mem_heapsize(void) {
-  return (size_t)(mem_brk - mem_start_brk);
+  return (size_t)(mem_brk - mem_start_brk) + mem_mapped_bytes;
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size since the last
+ *    mem_reset_brk. Mapped pages can be given back, so unlike the brk
+ *    heap alone this can be more than the current size.
+ */
+size_t mem_heap_peak(void) {
+  size_t size = mem_heapsize();
+  return (size > mem_peak) ? size : mem_peak;
 }
 
 /*
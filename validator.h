@@ -43,13 +43,14 @@ typedef struct range_t {
 // range list to detect any overlapping allocated blocks.
 
 
-// add_range - As directed by request opnum in trace tracenum,
+// add_range_usable - As directed by request opnum in trace tracenum,
 // we've just called the student's malloc to allocate a block of
-// size bytes at addr lo. After checking the block for correctness,
-// we create a range struct for this block and add it to the range list.
-static int add_range(const malloc_impl_t *impl, range_t **ranges, char *lo,
-    int size, int tracenum, int opnum) {
-  char *hi = lo + size - 1;
+// size bytes at addr lo, with usable bytes the caller may use. After
+// checking the block for correctness, we create a range struct for this
+// block and add it to the range list.
+static int add_range_usable(range_t **ranges, char *lo, size_t size,
+    size_t usable, int tracenum, int opnum) {
+  char *hi = lo + usable - 1;
   range_t *p;
   range_t *pnext;
 
@@ -58,14 +59,22 @@ static int add_range(const malloc_impl_t *impl, range_t **ranges, char *lo,
 
   assert(size > 0);
 
+  // The allocator may hand back more than was asked for, never less. The
+  // slack is the caller's to use, so it counts towards overlap below.
+  if (usable < size) {
+    printf("Usable size smaller than request\n");
+    return 0;
+  }
+
   // Payload addresses must be R_ALIGNMENT-byte aligned
   if (!IS_ALIGNED(lo)) {
     printf("Not Aligned!\n");
     return 0;
   }
   
-  // The payload must lie within the extent of the heap
-  if (hi > (char *)my_heap_hi()) {
+  // The payload must lie within the extent of the heap, or within pages
+  // that memlib mapped for a large block
+  if (!mem_contains(lo, hi)) {
     printf("Payload not in heap\n");
     return 0;
   }
@@ -88,10 +97,23 @@ static int add_range(const malloc_impl_t *impl, range_t **ranges, char *lo,
   new_range->hi = hi;
   new_range->next = *ranges;
   *ranges = new_range;
+
+  // Scribble over the slack, so that an allocator keeping its own data
+  // there gets caught by the heap checker or a later operation.
+  memset(lo + size, 0x5A, usable - size);
  
   return 1;
 }
 
+// add_range - add_range_usable for a block the impl knows the usable size
+// of. A block with no header to ask, such as one from a region or a
+// handle block, goes straight to add_range_usable with size as usable.
+static int add_range(const malloc_impl_t *impl, range_t **ranges, char *lo,
+    size_t size, int tracenum, int opnum) {
+  return add_range_usable(ranges, lo, size, impl->usable_size(lo),
+                          tracenum, opnum);
+}
+
 // remove_range - Free the range record of block whose payload starts at lo
 static void remove_range(range_t **ranges, char *lo) {
   range_t *p = NULL;
@@ -133,8 +155,8 @@ static void clear_ranges(range_t **ranges) {
 int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
   int i = 0;
   int index = 0;
-  int size = 0;
-  int oldsize = 0;
+  size_t size = 0;
+  size_t oldsize = 0;
   char *newp = NULL;
   char *oldp = NULL;
   char *p = NULL;
@@ -148,6 +170,7 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
     malloc_error(tracenum, 0, "impl init failed.");
     return 0;
   }
+  impl->reserve(trace->warm_sizes, trace->warm_counts, trace->num_warm);
 
   // Interpret each operation in the trace in order
   for (i = 0; i < trace->num_ops; i++) {
@@ -157,8 +180,13 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
     switch (trace->ops[i].type) {
       case ALLOC:  // malloc
 
-        // Call the student's malloc
-        if ((p = (char *) impl->malloc(size)) == NULL) {
+        // Call the student's malloc, with the lifetime hint if there is one
+        if (trace->ops[i].hint != MY_HINT_NONE) {
+          p = (char *) impl->malloc_hint(size, trace->ops[i].hint);
+        } else {
+          p = (char *) impl->malloc(size);
+        }
+        if (p == NULL) {
           malloc_error(tracenum, i, "impl malloc failed.");
           return 0;
         }
@@ -173,7 +201,7 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
         // for if the region is copied via realloc.
         char first_check = (char)index;
 
-        for (int j = 0; j < size; j++) {
+        for (size_t j = 0; j < size; j++) {
           *((char *)p + j) = first_check;
         }
 
@@ -182,6 +210,55 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
         trace->block_sizes[index] = size;
         break;
 
+      case MEMALIGN:  // memalign
+
+        // Call the student's memalign
+        if ((p = (char *) impl->memalign(trace->ops[i].alignment, size)) == NULL) {
+          malloc_error(tracenum, i, "impl memalign failed.");
+          return 0;
+        }
+
+        // On top of the usual checks, the payload must honor the
+        // alignment that was asked for.
+        if (((uintptr_t)p % trace->ops[i].alignment) != 0) {
+          printf("Not aligned to %zu bytes!\n", trace->ops[i].alignment);
+          return 0;
+        }
+        if (add_range(impl, &ranges, p, size, tracenum, i) == 0)
+          return 0;
+
+        for (size_t j = 0; j < size; j++) {
+          *((char *)p + j) = (char)index;
+        }
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
+      case CALLOC:  // calloc
+
+        // Call the student's calloc
+        if ((p = (char *) impl->calloc(1, size)) == NULL) {
+          malloc_error(tracenum, i, "impl calloc failed.");
+          return 0;
+        }
+        if (add_range(impl, &ranges, p, size, tracenum, i) == 0)
+          return 0;
+
+        // Every byte of the payload must come back zero, no matter what
+        // the block held the last time it was allocated.
+        for (size_t j = 0; j < size; j++) {
+          if (*((char *)p + j) != 0) {
+            printf("calloc returned memory that was not zeroed\n");
+            return 0;
+          }
+          *((char *)p + j) = (char)index;
+        }
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
       case REALLOC:  // realloc
 
         // Call the student's realloc
@@ -206,7 +283,7 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
           oldsize = size;
 
         // Make sure that the oldp matches the newp
-        for (int j = 0; j < oldsize; j++) {
+        for (size_t j = 0; j < oldsize; j++) {
           if (*((char *)newp + j) != (char)index) {
             printf("invalid data copied");
             return 0;
@@ -216,7 +293,7 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
         // Put the new data in place to make sure the value was copied properly
 
         char second_check = (char)index;
-        for (int k=0; k < size; k++) {
+        for (size_t k=0; k < size; k++) {
           *((char *)newp + k) = second_check;
         }
  
@@ -233,6 +310,144 @@ int eval_mm_valid(const malloc_impl_t *impl, trace_t *trace, int tracenum) {
         impl->free(p);
         break;
 
+      case BATCH_ALLOC:  // batch of mallocs
+
+        // Call the student's malloc_batch, which must hand out every block
+        if (impl->malloc_batch(size, trace->ops[i].count,
+                               (void **)&trace->blocks[index]) != trace->ops[i].count) {
+          malloc_error(tracenum, i, "impl malloc_batch failed.");
+          return 0;
+        }
+
+        // Each block gets the same checks and fill as a single malloc
+        for (unsigned k = 0; k < trace->ops[i].count; k++) {
+          p = trace->blocks[index + k];
+          if (add_range(impl, &ranges, p, size, tracenum, i) == 0)
+            return 0;
+          for (size_t j = 0; j < size; j++) {
+            *((char *)p + j) = (char)(index + k);
+          }
+          trace->block_sizes[index + k] = size;
+        }
+        break;
+
+      case BATCH_FREE:  // batch of frees
+
+        // Remove every region from the list, then free them all at once
+        for (unsigned k = 0; k < trace->ops[i].count; k++) {
+          remove_range(&ranges, trace->blocks[index + k]);
+        }
+        impl->free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+        break;
+
+      case REGION_NEW:  // new region
+
+        if (!trace_region_new(impl, trace, &trace->ops[i])) {
+          malloc_error(tracenum, i, "impl region_create failed.");
+          return 0;
+        }
+        break;
+
+      case REGION_ALLOC:  // alloc from a region
+
+        // Same checks and fill as a malloc. Blocks from a real region have
+        // no slack to scribble over.
+        if ((p = trace_region_alloc(impl, trace, &trace->ops[i])) == NULL) {
+          malloc_error(tracenum, i, "impl region_alloc failed.");
+          return 0;
+        }
+        if (add_range_usable(&ranges, p, size,
+                             (impl->region_create != NULL) ? size : impl->usable_size(p),
+                             tracenum, i) == 0)
+          return 0;
+        for (size_t j = 0; j < size; j++) {
+          *((char *)p + j) = (char)index;
+        }
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
+      case REGION_RESET:  // drop a region's blocks
+      case REGION_DESTROY:
+
+        for (unsigned k = 0; k < trace->ops[i].count; k++) {
+          remove_range(&ranges, trace->blocks[trace->region_ids[index + k]]);
+        }
+        trace_region_drop(impl, trace, &trace->ops[i]);
+        break;
+
+      case HANDLE_ALLOC:  // movable alloc
+
+        // Same checks and fill as a malloc. The tag in front of a real
+        // handle block leaves it no slack to scribble over.
+        if ((p = trace_handle_alloc(impl, trace, index, size)) == NULL) {
+          malloc_error(tracenum, i, "impl halloc failed.");
+          return 0;
+        }
+        if (add_range_usable(&ranges, p, size,
+                             (impl->halloc != NULL) ? size : impl->usable_size(p),
+                             tracenum, i) == 0)
+          return 0;
+        for (size_t j = 0; j < size; j++) {
+          *((char *)p + j) = (char)index;
+        }
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        break;
+
+      case HANDLE_FREE:  // free a movable block
+
+        remove_range(&ranges, trace->blocks[index]);
+        trace_handle_free(impl, trace, index);
+        break;
+
+      case HANDLE_LOCK:  // pin a movable block
+
+        // Blocks only move in a compact, and blocks[] follows them there
+        if (trace_handle_lock(impl, trace, index) != trace->blocks[index]) {
+          malloc_error(tracenum, i, "handle moved outside a compact.");
+          return 0;
+        }
+        break;
+
+      case HANDLE_UNLOCK:  // unpin it
+
+        trace_handle_unlock(impl, trace, index);
+        break;
+
+      case COMPACT:  // move the unlocked blocks
+
+        // Every live handle block may have moved, except the locked ones,
+        // which come first. Each must still hold its data and must not
+        // overlap anything where it landed. How much the compact gives
+        // back is the impl's business, not a correctness question.
+        for (unsigned k = 0; k < trace->ops[i].count; k++) {
+          remove_range(&ranges, trace->blocks[trace->handle_ids[index + k]]);
+        }
+        if (impl->compact != NULL) {
+          impl->compact();
+        }
+        for (unsigned k = 0; k < trace->ops[i].count; k++) {
+          int id = trace->handle_ids[index + k];
+          p = trace_handle_lock(impl, trace, id);
+          if (k < trace->ops[i].locked && p != trace->blocks[id]) {
+            malloc_error(tracenum, i, "compact moved a locked handle.");
+            return 0;
+          }
+          for (size_t j = 0; j < trace->block_sizes[id]; j++) {
+            if (*((char *)p + j) != (char)id) {
+              printf("invalid data moved");
+              return 0;
+            }
+          }
+          if (add_range_usable(&ranges, p, trace->block_sizes[id],
+                               trace->block_sizes[id], tracenum, i) == 0)
+            return 0;
+          trace->blocks[id] = p;
+          trace_handle_unlock(impl, trace, id);
+        }
+        break;
+
       case WRITE:  // write
 
         break;